@@ -0,0 +1,336 @@
+/**
+ * Benchmarks that verify the complexity claims of the README.
+ *
+ * Each series sweeps one size parameter and times an operation for every
+ * value, reporting the time per unit of the documented cost model:
+ *
+ *   copy, equal, hash            O(1)
+ *   union, intersection,
+ *   difference, symmetric        O(v*log(u/v)), u and v the input sizes
+ *   *_diff                       O(d*log(n/d)), d the symmetric difference
+ *   map_intersection,
+ *   map_difference               O(v*log(u/v)), merging a map with a set
+ *   slice                        O(log n)
+ *   sorted_construction          O(n)
+ *   range_construction           O(n*log n)
+ *
+ * The log of the time per unit is fitted against the log of the swept
+ * parameter. If an operation scales as documented the fitted exponent is close
+ * to zero, while a kernel that is off by a factor n^k shows an exponent near k.
+ * Cache misses grow with the working set and typically add 0.1-0.3 to the
+ * exponents of the larger series.
+ *
+ * Results are written to stdout as JSON lines, one line per measurement and one
+ * line per fitted series. With --check the program exits with a non-zero status
+ * if a fitted exponent exceeds the tolerance.
+ *
+ * Build and run:
+ *
+ *   g++ -std=c++11 -O2 -pthread -I../src Complexity.cc -o complexity
+ *   ./complexity [--max-log-size N] [--tolerance T] [--check]
+ *
+ * Copyright (c) 2017 Olle Liljenzin
+ **/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "map.h"
+#include "set.h"
+
+typedef confluent::set<std::uint64_t> Set;
+typedef confluent::map<std::uint64_t, std::uint64_t> Map;
+
+struct Options {
+  size_t max_log_size = 18;
+  double tolerance = 0.4;
+  bool check = false;
+};
+
+struct Sample {
+  double x;
+  double ns_per_unit;
+};
+
+struct Series {
+  std::string name;
+  std::string parameter;
+  std::vector<Sample> samples;
+};
+
+static volatile size_t sink;
+
+// Returns the time of one invocation of an operation in nanoseconds, taken as
+// the best of a few rounds that each repeat the operation for some time.
+double time_ns(const std::function<size_t()>& op) {
+  typedef std::chrono::steady_clock clock;
+  const auto min_round = std::chrono::milliseconds(10);
+  double best = 0;
+  for (int round = 0; round < 3; ++round) {
+    size_t count = 0;
+    auto start = clock::now();
+    auto stop = start;
+    do {
+      sink += op();
+      ++count;
+      stop = clock::now();
+    } while (stop - start < min_round);
+    double ns =
+        std::chrono::duration<double, std::nano>(stop - start).count() / count;
+    if (round == 0 || ns < best)
+      best = ns;
+  }
+  return best;
+}
+
+// Unique random keys.
+std::vector<std::uint64_t> make_keys(size_t n, std::mt19937_64* rng) {
+  std::vector<std::uint64_t> keys;
+  keys.reserve(n);
+  Set seen;
+  while (keys.size() < n) {
+    std::uint64_t key = (*rng)();
+    if (seen.insert(key))
+      keys.push_back(key);
+  }
+  return keys;
+}
+
+double log2_ratio(double u, double v) {
+  return 1 + std::log2(u / v);
+}
+
+void report(Series* series,
+            double x,
+            double units,
+            double ns,
+            const char* extra = "") {
+  series->samples.push_back({x, ns / units});
+  std::printf(
+      "{\"series\":\"%s\",\"%s\":%.0f%s,\"ns\":%.1f,\"units\":%.1f,"
+      "\"ns_per_unit\":%.3f}\n",
+      series->name.c_str(), series->parameter.c_str(), x, extra, ns, units,
+      ns / units);
+  std::fflush(stdout);
+}
+
+// Least squares slope of log(ns_per_unit) against log(x).
+double fit_exponent(const Series& series) {
+  double n = series.samples.size();
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  for (const Sample& s : series.samples) {
+    double x = std::log(s.x);
+    double y = std::log(s.ns_per_unit);
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+  }
+  double d = n * sxx - sx * sx;
+  return d == 0 ? 0 : (n * sxy - sx * sy) / d;
+}
+
+std::vector<size_t> sizes(size_t min_log, size_t max_log) {
+  std::vector<size_t> result;
+  for (size_t k = min_log; k <= max_log; ++k)
+    result.push_back(size_t(1) << k);
+  return result;
+}
+
+// Sweeps the size of a large set while copying, comparing and hashing it.
+void constant_time(const Options& options, std::vector<Series>* out) {
+  std::mt19937_64 rng(1);
+  Series copy{"copy", "n", {}};
+  Series equal{"equal", "n", {}};
+  Series hash{"hash", "n", {}};
+  for (size_t n : sizes(10, options.max_log_size)) {
+    std::vector<std::uint64_t> keys = make_keys(n, &rng);
+    Set a(keys.begin(), keys.end());
+    std::shuffle(keys.begin(), keys.end(), rng);
+    Set b(keys.begin(), keys.end());
+    report(&copy, n, 1, time_ns([&] {
+             Set c(a);
+             return c.size();
+           }));
+    report(&equal, n, 1, time_ns([&] { return size_t(a == b); }));
+    report(&hash, n, 1, time_ns([&] { return a.hash(); }));
+  }
+  out->push_back(copy);
+  out->push_back(equal);
+  out->push_back(hash);
+}
+
+// Sweeps the size v of the smaller input to set operations with a large input
+// of size u.
+void small_merges(const Options& options, std::vector<Series>* out) {
+  std::mt19937_64 rng(2);
+  size_t u = size_t(1) << options.max_log_size;
+  std::vector<std::uint64_t> keys = make_keys(2 * u, &rng);
+  Set a(keys.begin(), keys.begin() + u);
+  Series series[] = {{"union", "v", {}},
+                     {"intersection", "v", {}},
+                     {"difference", "v", {}},
+                     {"symmetric", "v", {}}};
+  char extra[64];
+  std::snprintf(extra, sizeof(extra), ",\"u\":%zu", u);
+  for (size_t v : sizes(4, options.max_log_size - 2)) {
+    // Half of the smaller input overlaps the larger input.
+    std::vector<std::uint64_t> small(keys.begin() + u - v / 2,
+                                     keys.begin() + u + v / 2);
+    Set b(small.begin(), small.end());
+    double units = v * log2_ratio(u, v);
+    report(&series[0], v, units, time_ns([&] { return (a | b).size(); }),
+           extra);
+    report(&series[1], v, units, time_ns([&] { return (a & b).size(); }),
+           extra);
+    report(&series[2], v, units, time_ns([&] { return (a - b).size(); }),
+           extra);
+    report(&series[3], v, units, time_ns([&] { return (a ^ b).size(); }),
+           extra);
+  }
+  for (const Series& s : series)
+    out->push_back(s);
+}
+
+// Sweeps the size d of the symmetric difference between two large sets that
+// share most of their nodes.
+void similar_merges(const Options& options, std::vector<Series>* out) {
+  std::mt19937_64 rng(3);
+  size_t n = size_t(1) << options.max_log_size;
+  std::vector<std::uint64_t> keys = make_keys(n + n / 2, &rng);
+  Set a(keys.begin(), keys.begin() + n);
+  Series series[] = {{"union_diff", "d", {}},
+                     {"intersection_diff", "d", {}},
+                     {"difference_diff", "d", {}},
+                     {"symmetric_diff", "d", {}}};
+  char extra[64];
+  std::snprintf(extra, sizeof(extra), ",\"n\":%zu", n);
+  for (size_t d : sizes(4, options.max_log_size - 2)) {
+    Set b = a;
+    for (size_t i = 0; i < d / 2; ++i) {
+      b.erase(keys[i]);
+      b.insert(keys[n + i]);
+    }
+    double units = d * log2_ratio(n, d);
+    report(&series[0], d, units, time_ns([&] { return (a | b).size(); }),
+           extra);
+    report(&series[1], d, units, time_ns([&] { return (a & b).size(); }),
+           extra);
+    report(&series[2], d, units, time_ns([&] { return (a - b).size(); }),
+           extra);
+    report(&series[3], d, units, time_ns([&] { return (a ^ b).size(); }),
+           extra);
+  }
+  for (const Series& s : series)
+    out->push_back(s);
+}
+
+// Sweeps the size v of a key set merged with a large map of size u.
+void map_merges(const Options& options, std::vector<Series>* out) {
+  std::mt19937_64 rng(4);
+  size_t u = size_t(1) << options.max_log_size;
+  std::vector<std::uint64_t> keys = make_keys(2 * u, &rng);
+  Map m;
+  for (size_t i = 0; i < u; ++i)
+    m.insert(std::make_pair(keys[i], keys[i] / 2));
+  Series series[] = {{"map_intersection", "v", {}},
+                     {"map_difference", "v", {}}};
+  char extra[64];
+  std::snprintf(extra, sizeof(extra), ",\"u\":%zu", u);
+  for (size_t v : sizes(4, options.max_log_size - 2)) {
+    std::vector<std::uint64_t> small(keys.begin() + u - v / 2,
+                                     keys.begin() + u + v / 2);
+    Set s(small.begin(), small.end());
+    double units = v * log2_ratio(u, v);
+    report(&series[0], v, units, time_ns([&] { return (m & s).size(); }),
+           extra);
+    report(&series[1], v, units, time_ns([&] { return (m - s).size(); }),
+           extra);
+  }
+  for (const Series& s : series)
+    out->push_back(s);
+}
+
+// Sweeps the size of sets that are sliced and constructed.
+void slices_and_construction(const Options& options,
+                             std::vector<Series>* out) {
+  std::mt19937_64 rng(5);
+  Series slice{"slice", "n", {}};
+  Series sorted{"sorted_construction", "n", {}};
+  Series range{"range_construction", "n", {}};
+  for (size_t n : sizes(10, options.max_log_size)) {
+    std::vector<std::uint64_t> keys = make_keys(n, &rng);
+    Set a(keys.begin(), keys.end());
+    std::vector<std::uint64_t> ordered(a.begin(), a.end());
+    std::uniform_int_distribution<size_t> pos(0, n);
+    report(&slice, n, std::log2(n), time_ns([&] {
+             size_t i = pos(rng);
+             size_t j = pos(rng);
+             if (i > j)
+               std::swap(i, j);
+             return Set(a.begin() + i, a.begin() + j).size();
+           }));
+    report(&sorted, n, n, time_ns([&] {
+             return Set(confluent::sorted_unique, ordered.begin(),
+                        ordered.end())
+                 .size();
+           }));
+    report(&range, n, n * std::log2(n), time_ns([&] {
+             return Set(keys.begin(), keys.end()).size();
+           }));
+  }
+  out->push_back(slice);
+  out->push_back(sorted);
+  out->push_back(range);
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--max-log-size") && i + 1 < argc) {
+      options.max_log_size = std::strtoul(argv[++i], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--tolerance") && i + 1 < argc) {
+      options.tolerance = std::strtod(argv[++i], nullptr);
+    } else if (!std::strcmp(argv[i], "--check")) {
+      options.check = true;
+    } else {
+      std::fprintf(stderr,
+                   "usage: %s [--max-log-size N] [--tolerance T] [--check]\n",
+                   argv[0]);
+      return 2;
+    }
+  }
+  if (options.max_log_size < 12) {
+    std::fprintf(stderr, "--max-log-size must be at least 12\n");
+    return 2;
+  }
+
+  std::vector<Series> series;
+  constant_time(options, &series);
+  small_merges(options, &series);
+  similar_merges(options, &series);
+  map_merges(options, &series);
+  slices_and_construction(options, &series);
+
+  int failures = 0;
+  for (const Series& s : series) {
+    double exponent = fit_exponent(s);
+    bool ok = std::fabs(exponent) <= options.tolerance;
+    if (!ok)
+      ++failures;
+    std::printf("{\"fit\":\"%s\",\"parameter\":\"%s\",\"exponent\":%.3f,"
+                "\"tolerance\":%.3f,\"ok\":%s}\n",
+                s.name.c_str(), s.parameter.c_str(), exponent,
+                options.tolerance, ok ? "true" : "false");
+  }
+  return options.check && failures ? 1 : 0;
+}
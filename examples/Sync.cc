@@ -0,0 +1,154 @@
+/**
+ * @example Sync.cc
+ *
+ * The program demonstrates how a replica of a map held by one process is
+ * synchronized with the source map held by another process, transferring only
+ * the elements that differ.
+ *
+ * The processes are forked from a common parent and connected by a Unix
+ * socket pair. Both start with the same map, after which the source is
+ * updated while the replica is cut off. The replica then pulls the changes, in
+ * both fingerprint modes, and verifies the result against a copy of the
+ * source that it updated locally.
+ *
+ * Let n be the size of the map and let d be the number of updates.
+ * The synchronization transfers O(d*log(n/d)) bytes.
+ *
+ * Copyright (c) 2017 Olle Liljenzin
+ **/
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "sync.h"
+
+typedef confluent::map<std::uint64_t, std::string> Map;
+
+namespace {
+
+// A buffered stream over a file descriptor that counts written bytes.
+class FdStream {
+ public:
+  explicit FdStream(int fd) : fd_(fd), written_(0) {}
+
+  void write(const char* s, size_t n) {
+    buffer_.insert(buffer_.end(), s, s + n);
+    written_ += n;
+  }
+
+  void read(char* s, size_t n) {
+    while (n > 0) {
+      ssize_t r = ::read(fd_, s, n);
+      if (r <= 0)
+        throw std::runtime_error("read failed");
+      s += r;
+      n -= r;
+    }
+  }
+
+  void flush() {
+    size_t offset = 0;
+    while (offset < buffer_.size()) {
+      ssize_t r =
+          ::write(fd_, buffer_.data() + offset, buffer_.size() - offset);
+      if (r <= 0)
+        throw std::runtime_error("write failed");
+      offset += r;
+    }
+    buffer_.clear();
+  }
+
+  size_t written() const { return written_; }
+
+ private:
+  int fd_;
+  std::vector<char> buffer_;
+  size_t written_;
+};
+
+Map makeMap(size_t n) {
+  Map map;
+  for (std::uint64_t i = 0; i < n; ++i)
+    map.insert({i * 7, "value " + std::to_string(i)});
+  return map;
+}
+
+// Applies d updates, erasing, inserting and changing elements.
+void update(Map* map, size_t d) {
+  for (std::uint64_t i = 0; i < d; ++i) {
+    switch (i % 3) {
+      case 0:
+        map->erase(i * 7919 * 7);
+        break;
+      case 1:
+        map->insert({i * 7919 * 7 + 1, "inserted"});
+        break;
+      case 2:
+        map->insert_or_assign({i * 7919 * 7, "changed"});
+        break;
+    }
+  }
+}
+
+void runSource(int fd, Map source, size_t d) {
+  update(&source, d);
+  FdStream stream(fd);
+  confluent::synchronizer<Map> hashed;
+  hashed.serve(stream, source);
+  confluent::sync_options options;
+  options.fingerprint = confluent::fingerprint_mode::strong;
+  confluent::synchronizer<Map> strong(options);
+  strong.serve(stream, source);
+  std::cout << "source sent " << stream.written() << " bytes" << std::endl;
+}
+
+void runReplica(int fd, Map replica, size_t d) {
+  Map expected = replica;
+  update(&expected, d);
+  assert(replica != expected);
+
+  FdStream stream(fd);
+  confluent::synchronizer<Map> hashed;
+  Map result = hashed.pull(stream, replica);
+  assert(result == expected);
+  confluent::sync_options options;
+  options.fingerprint = confluent::fingerprint_mode::strong;
+  confluent::synchronizer<Map> strong(options);
+  result = strong.pull(stream, replica);
+  assert(result == expected);
+  std::cout << "replica synchronized " << result.size() << " elements"
+            << std::endl;
+}
+
+}  // namespace
+
+int main() {
+  const size_t n = 100000;
+  const size_t d = 100;
+  Map map = makeMap(n);
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    return 1;
+  pid_t pid = fork();
+  if (pid < 0)
+    return 1;
+  if (pid == 0) {
+    close(fds[0]);
+    runReplica(fds[1], map, d);
+    return 0;
+  }
+  close(fds[1]);
+  runSource(fds[0], map, d);
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -39,6 +39,20 @@ inline size_t hash_combine(size_t h1, size_t h2, size_t h3, size_t h4) {
 
 struct map_tag {};
 
+template <class Traits>
+const typename Traits::key_type& key_of(
+    const env<Traits, map_tag>& env,
+    const typename Traits::value_type& value) {
+  env.silence_unused_warning();
+  return value.first;
+}
+
+template <class Traits>
+size_t priority(const env<Traits, map_tag>& env,
+                const typename Traits::value_type& value) {
+  return priority(env.key_set_env_, value.first);
+}
+
 template <class Traits>
 node_ptr<Traits> make_node(const env<Traits, map_tag>& env,
                            const typename Traits::value_type& value,
@@ -73,6 +87,13 @@ node_ptr<Traits> make_node(const env<Traits, map_tag>& env,
                    std::move(right));
 }
 
+template <class Traits>
+typename operation_cache<Traits>::ranker_type element_ranker(
+    const env<Traits, map_tag>& env) {
+  env.silence_unused_warning();
+  return access::rank<typename Traits::container>();
+}
+
 template <class Traits, class Left, class Right>
 node_ptr<Traits> set_intersection(const env<Traits>& env,
                                   Left&& left,
@@ -172,6 +193,126 @@ bool insert_or_assign(const env<Traits>& env,
   return insert_or_assign_n(env, p, make_node(env, first, last));
 }
 
+// Erases the elements of a map that have the keys of the elements of another
+// map, whatever their mapped values.
+template <class Container>
+Container erase_keys(const Container& container,
+                     const Container& keys,
+                     map_tag) {
+  return container - keys.key_set();
+}
+
+// Merges the changes from a common ancestor to two versions of a map in one
+// recursive pass over the three trees. The trees are represented by subtree
+// cursors as in fused_evaluation. A range is not visited when two of the
+// versions share the same whole subtree there, since the result is then given
+// by the third version or by the shared subtree.
+template <class Traits, class Resolver>
+struct three_way_merge {
+  typedef typename Traits::key_type key_type;
+  typedef typename Traits::mapped_type mapped_type;
+  typedef subtree_cursor<Traits> cursor;
+  typedef typename operation_cache<Traits>::ranker_type ranker_type;
+
+  three_way_merge(const env<Traits>& env,
+                  ranker_type ranker,
+                  Resolver& resolver)
+      : env_(env), ranker_(ranker), resolver_(resolver) {}
+
+  node_ptr<Traits> operator()(cursor ancestor,
+                              cursor ours,
+                              cursor theirs,
+                              const key_type* lo,
+                              const key_type* hi) {
+    seek(env_, &ancestor, lo, hi);
+    seek(env_, &ours, lo, hi);
+    seek(env_, &theirs, lo, hi);
+    if (*ours.node_ == *theirs.node_ && known(&ours, lo, hi))
+      return *ours.node_;
+    if (*ancestor.node_ == *ours.node_ && known(&ancestor, lo, hi) &&
+        known(&theirs, lo, hi))
+      return *theirs.node_;
+    if (*ancestor.node_ == *theirs.node_ && known(&ancestor, lo, hi) &&
+        known(&ours, lo, hi))
+      return *ours.node_;
+
+    const node<Traits>* top = nullptr;
+    for (const cursor* c : {&ancestor, &ours, &theirs}) {
+      const node<Traits>* p = c->node_->get();
+      if (p && (!top || rank(env_, *p, *top) == ranking::LEFT))
+        top = p;
+    }
+    const node_ptr<Traits>* a = element(ancestor, *top);
+    const node_ptr<Traits>* o = element(ours, *top);
+    const node_ptr<Traits>* t = element(theirs, *top);
+
+    node_ptr<Traits> resolved;
+    const node_ptr<Traits>* result;
+    if (same(o, t) || same(a, t)) {
+      result = o;
+    } else if (same(a, o)) {
+      result = t;
+    } else {
+      const mapped_type* value =
+          resolver_(top->key(), a ? &(*a)->mapped() : nullptr,
+                    o ? &(*o)->mapped() : nullptr,
+                    t ? &(*t)->mapped() : nullptr);
+      if (!value)
+        result = nullptr;
+      else if (o && value == &(*o)->mapped())
+        result = o;
+      else if (t && value == &(*t)->mapped())
+        result = t;
+      else {
+        resolved = make_node(env_, std::make_pair(top->key(), *value));
+        result = &resolved;
+      }
+    }
+
+    const key_type& key = top->key();
+    node_ptr<Traits> left = (*this)(child(ancestor, *top, true),
+                                    child(ours, *top, true),
+                                    child(theirs, *top, true), lo, &key);
+    node_ptr<Traits> right = (*this)(child(ancestor, *top, false),
+                                     child(ours, *top, false),
+                                     child(theirs, *top, false), &key, hi);
+    if (!result)
+      return join(env_, std::move(left), std::move(right));
+    if ((*result)->left_ == left && (*result)->right_ == right)
+      return *result;
+    return make_node(env_, **result, std::move(left), std::move(right));
+  }
+
+  // Tests if the content of a cursor within a range is given by its subtree.
+  bool known(cursor* c, const key_type* lo, const key_type* hi) {
+    return !*c->node_ || whole(env_, c, lo, hi);
+  }
+
+  const node_ptr<Traits>* element(const cursor& c, const node<Traits>& top) {
+    const node_ptr<Traits>& p = *c.node_;
+    if (p && (p.get() == &top || rank(env_, *p, top) == ranking::SAME))
+      return &p;
+    return nullptr;
+  }
+
+  bool same(const node_ptr<Traits>* x, const node_ptr<Traits>* y) {
+    if (!x || !y)
+      return x == y;
+    return *x == *y || ranker_(env_, **x, **y) == ranking::SAME;
+  }
+
+  cursor child(cursor c, const node<Traits>& top, bool left) {
+    if (element(c, top))
+      return child_cursor(c, left);
+    c.whole_ = false;
+    return c;
+  }
+
+  const env<Traits>& env_;
+  const ranker_type ranker_;
+  Resolver& resolver_;
+};
+
 template <class Key,
           class T,
           class Compare,
@@ -219,9 +360,11 @@ struct node<Traits, map_tag> {
                          size_t mapped_hash) {
     size_t hash = hash_combine(internal::hash(left), internal::hash(right),
                                mapped_hash, key_node->hash_);
-    std::unique_ptr<node> p(new node(value, std::move(key_node),
-                                     std::move(left), std::move(right), hash));
-    return get_unique_node(env, std::move(p));
+    return get_unique_node(env, allocate_node<Traits>([&](void* p) {
+                             return new (p)
+                                 node(value, std::move(key_node),
+                                      std::move(left), std::move(right), hash);
+                           }));
   }
 
   const key_type& key() const { return value_.first; }
@@ -231,7 +374,7 @@ struct node<Traits, map_tag> {
   size_t size() const { return key_node_->size(); }
   const key_node_ptr& key_node() const { return key_node_; }
 
-  std::atomic<size_t> reference_count_;
+  std::atomic<node_count_type> reference_count_;
   node* next_;
   value_type value_;
   key_node_ptr key_node_;
@@ -268,6 +411,7 @@ struct env<Traits, map_tag> : env_base<Traits> {
   }
 
   static bool equal(const mapped_type& lhs, const mapped_type& rhs) {
+    ++env_base<Traits>::get_call_counts().equality_tests_;
     return provider_->mapped_eq()(lhs, rhs);
   }
 
@@ -277,10 +421,11 @@ struct env<Traits, map_tag> : env_base<Traits> {
 
   static bool equal(const value_type& lhs, const value_type& rhs) {
     return key_set_env_type::equal(lhs.first, rhs.first) &&
-           provider_->mapped_eq()(lhs.second, rhs.second);
+           equal(lhs.second, rhs.second);
   }
 
   static size_t hash(const mapped_type& mapped) {
+    ++env_base<Traits>::get_call_counts().hashes_;
     return provider_->mapped_hash()(mapped);
   }
 
@@ -332,20 +477,43 @@ class map_provider {
    * @param mapped_equal comparison function that tests if mapped elements are
    *     equal
    * @param set_provider set_provider that will be extended by this map_provider
+   * @param options options that control how nodes are managed
    **/
   map_provider(const MappedHash& mapped_hash = MappedHash(),
                const MappedEqual& mapped_equal = MappedEqual(),
                const std::shared_ptr<set_provider_type>& set_provider =
-                   set_provider_type::default_provider())
+                   set_provider_type::default_provider(),
+               const provider_options& options = provider_options())
       : mapped_hash_(mapped_hash),
         mapped_equal_(mapped_equal),
-        set_provider_(set_provider) {
+        set_provider_(set_provider),
+        options_(options),
+        node_table_(options.concurrency),
+        reclaimer_(options),
+        operation_cache_(options.operation_cache_size, options.concurrency) {
     assert(set_provider_);
+    reclaimer_.start(this);
   }
 
+  /**
+   * Constructs a new map_provider with default constructed functors.
+   *
+   * @param options options that control how nodes are managed
+   * @param set_provider set_provider that will be extended by this map_provider
+   **/
+  explicit map_provider(const provider_options& options,
+                        const std::shared_ptr<set_provider_type>& set_provider =
+                            set_provider_type::default_provider())
+      : map_provider(MappedHash(), MappedEqual(), set_provider, options) {}
+
   map_provider(const map_provider&) = delete;
 
-  ~map_provider() { assert(size() == 0); }
+  ~map_provider() {
+    clear_operation_cache();
+    reclaimer_.stop();
+    reclaim();
+    assert(size() == 0);
+  }
 
   /**
    * Returns the hash function for mapped values.
@@ -364,12 +532,54 @@ class map_provider {
     return set_provider_;
   }
 
+  /**
+   * Returns the options this provider was created with.
+   **/
+  const provider_options& options() const { return options_; }
+
   /**
    * Returns the number of nodes allocated by this provider.
    **/
-  size_t size() const {
-    std::lock_guard<std::mutex> lock(hash_table_.mutex_);
-    return hash_table_.size_;
+  size_t size() const { return node_table_.size(); }
+
+  /**
+   * Returns the number of unreferenced nodes queued for reclamation. Freeing a
+   * queued node may queue its children in its place.
+   **/
+  size_t pending() const { return reclaimer_.pending(); }
+
+  /**
+   * Frees queued unreferenced nodes when reclamation is deferred. Freeing the
+   * nodes of this provider may queue key nodes for reclamation by the
+   * set_provider.
+   *
+   * @param max_count maximum number of nodes to free
+   * @return number of freed nodes
+   **/
+  size_t reclaim(size_t max_count = std::numeric_limits<size_t>::max()) {
+    internal::env<traits> env(this);
+    return reclaimer_.reclaim(max_count);
+  }
+
+  /**
+   * Returns a snapshot of the statistics of this provider. Key nodes and
+   * invocations of key functors are accounted for by the set_provider.
+   * Invocations of functors are counted per thread and included when the
+   * invoking operations have returned.
+   **/
+  provider_statistics statistics() const {
+    internal::env_base<traits>::flush_call_counts();
+    return internal::make_statistics(node_table_, call_counters_,
+                                      operation_cache_);
+  }
+
+  /**
+   * Removes all entries from the operation cache, releasing the nodes they
+   * keep alive.
+   **/
+  void clear_operation_cache() {
+    internal::env<traits> env(this);
+    operation_cache_.clear();
   }
 
   /**
@@ -385,7 +595,12 @@ class map_provider {
   const MappedHash mapped_hash_;
   const MappedEqual mapped_equal_;
   const std::shared_ptr<set_provider_type> set_provider_;
-  internal::hash_table<traits> hash_table_;
+  const provider_options options_;
+  internal::node_table<traits> node_table_;
+  internal::node_allocator<traits> node_allocator_;
+  internal::reclaimer<traits> reclaimer_;
+  internal::call_counters call_counters_;
+  internal::operation_cache<traits> operation_cache_;
 };
 
 /**
@@ -428,7 +643,10 @@ class map {
       provider_type;
   typedef std::shared_ptr<provider_type> provider_ptr;
   typedef confluent::iterator<traits> iterator;
-  typedef std::reverse_iterator<iterator> reverse_iterator;
+  typedef confluent::reverse_iterator<traits> reverse_iterator;
+  typedef confluent::transient<traits> transient_type;
+  typedef confluent::expression<traits> expression_type;
+  typedef confluent::delta<traits> delta_type;
 
  private:
   typedef typename key_set_type::provider_type set_provider_type;
@@ -436,6 +654,7 @@ class map {
   typedef typename internal::node<key_set_traits> key_node_type;
 
   friend struct confluent::iterator<traits>;
+  friend struct internal::access;
 
  public:
   /**
@@ -466,6 +685,26 @@ class map {
     insert(first, last);
   }
 
+  /**
+   * Creates a new map from a range of elements sorted by unique keys.
+   *
+   * Result is undefined if the range is not sorted or contains equal keys.
+   *
+   * @param first range start
+   * @param last range end
+   * @param provider map_provider to use for this map (optional)
+   *
+   * Complexity: O(n) expected time and memory.
+   **/
+  template <class InputIterator>
+  map(sorted_unique_t,
+      InputIterator first,
+      InputIterator last,
+      provider_ptr provider = provider_type::default_provider())
+      : provider_(std::move(provider)) {
+    insert(sorted_unique, first, last);
+  }
+
   /**
    * Creates a new map from an initializer_list.
    *
@@ -553,6 +792,25 @@ class map {
     return internal::insert(env(), &node_, first, last);
   }
 
+  /**
+   * Inserts a range of elements sorted by unique keys into this map.
+   *
+   * New element are inserted if they are not contained before.
+   *
+   * Result is undefined if the range is not sorted or contains equal keys.
+   *
+   * @param first range start
+   * @param last range end
+   * @return the number of inserted elements
+   *
+   * Complexity: Same cost as first creating a map from the given range in
+   *     O(n) and then inserting the created map into this map.
+   **/
+  template <class InputIterator>
+  size_t insert(sorted_unique_t, InputIterator first, InputIterator last) {
+    return internal::insert_sorted(env(), &node_, first, last);
+  }
+
   /**
    * Inserts elements from an initializer_list into this map.
    *
@@ -1311,15 +1569,50 @@ class map {
    * Let m be the size of the other.
    * Let d be the size of the difference between this map and the other map.
    *
-   * Complexity: O(min(m * log(n/m), d * log(n/d))) expected time and memory.
+   * Complexity: O(min(m * log(n/m), d * log(n/d))) expected time and
+   * O(log n) expected memory.
    *
-   * Note: The operation will return directly if m > n.
+   * Note: The operation will return directly if m > n. No nodes are created.
    **/
   bool includes(const map& other) const {
     check(other);
     return internal::includes(env(), &map::rank, node_, other.node_);
   }
 
+  /**
+   * Tests if this map and another map have any element in common.
+   *
+   * Result is undefined if not both maps are using the same map_provider.
+   *
+   * @param other map to test
+   * @return true if an element is contained in both maps, false otherwise
+   *
+   * Let n be the size of the larger map.
+   * Let m be the size of the smaller map.
+   * Let d be the size of the difference between this map and the other map.
+   *
+   * Complexity: O(min(m * log(n/m), d * log(n/d))) expected time and
+   * O(log n) expected memory.
+   *
+   * Note: The operation returns when the first common element is found. No
+   * nodes are created.
+   **/
+  bool intersects(const map& other) const {
+    check(other);
+    return internal::intersects(env(), &map::rank, node_, other.node_);
+  }
+
+  /**
+   * Tests if this map and another map have no element in common.
+   *
+   * disjoint(other);
+   *
+   * is equivalent to
+   *
+   * !intersects(other);
+   **/
+  bool disjoint(const map& other) const { return !intersects(other); }
+
   /**
    * Returns a set containing the keys in this map.
    *
@@ -1330,6 +1623,66 @@ class map {
                         node_ ? node_->key_node() : nullptr);
   }
 
+  /**
+   * Returns a transient with the content of this map, for applying a batch of
+   * updates that are shared in a single pass when done.
+   *
+   * map::transient_type t = m.transient();
+   * t.insert_or_assign(v1);
+   * t.erase(k2);
+   * m = t.persistent();
+   *
+   * Complexity: Constant in time and memory.
+   **/
+  transient_type transient() const { return transient_type(*this); }
+
+  /**
+   * Returns an expression with this map as its only operand, for combining
+   * several maps in a single pass when the expression is evaluated.
+   *
+   * map r = m.lazy() | x | y;
+   *
+   * Complexity: Constant in time and memory.
+   **/
+  expression_type lazy() const { return expression_type(*this); }
+
+  /**
+   * Returns the delta that changes this map into another map.
+   *
+   * Result is undefined if not both maps are using the same map_provider.
+   *
+   * @param to the new version
+   * @return a delta with the elements added and removed by the change
+   *
+   * Let n be the size of the larger map.
+   * Let d be the size of the difference between the maps.
+   *
+   * Complexity: O(d * log(n/d)) expected time and memory.
+   **/
+  delta_type delta(const map& to) const {
+    check(to);
+    return delta_type::between(*this, to);
+  }
+
+  /**
+   * Applies a delta to this map.
+   *
+   * Result is undefined if not the delta is using the same map_provider as
+   * this map.
+   *
+   * @param delta delta to apply
+   * @return a reference to this map after it has been updated
+   *
+   * Let n be the size of this map.
+   * Let d be the size of the delta.
+   *
+   * Complexity: O(d * log(n/d)) expected time and memory.
+   **/
+  map& apply(const delta_type& delta) {
+    *this = delta.apply(*this);
+    return *this;
+  }
+
   /**
    * Returns a shared pointer to the map_provider used by this map.
    **/
@@ -1475,6 +1828,192 @@ size_t hash(const map<T, Compare, Hash, Equal, MappedHash, MappedEqual>& x) {
   return x.hash();
 }
 
+/**
+ * Merges the changes from a common ancestor to two versions of a map.
+ *
+ * For every key, the result takes the version that differs from the
+ * ancestor, or either version if they agree. Keys that were changed
+ * differently in both versions are conflicts, which are passed to a resolver:
+ *
+ * const T* resolver(const Key& key,
+ *                   const T* ancestor,
+ *                   const T* ours,
+ *                   const T* theirs);
+ *
+ * The arguments point to the values mapped by the key in each map, or are null
+ * if a map does not contain the key. The resolver returns a pointer to the
+ * value the key should map to in the result, or null to leave the key out. The
+ * returned value is copied before the resolver is called again.
+ *
+ * map merged = merge3(base, ours, theirs,
+ *                     [](const Key&, const T*, const T* o, const T*) {
+ *                       return o;
+ *                     });
+ *
+ * Result is undefined if not all maps are using the same map_provider.
+ *
+ * @param ancestor the common ancestor
+ * @param ours one version derived from the ancestor
+ * @param theirs another version derived from the ancestor
+ * @param resolver function that resolves conflicts
+ * @return a map with the changes of both versions applied to the ancestor
+ *
+ * Let n be the size of the largest map.
+ * Let m be the number of elements changed in any of the versions.
+ *
+ * Complexity: O(m * log(n/m)) expected time and memory, creating only the
+ * nodes of the result.
+ **/
+template <class Key,
+          class T,
+          class Compare,
+          class Hash,
+          class Equal,
+          class MappedHash,
+          class MappedEqual,
+          class Resolver>
+map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual> merge3(
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& ancestor,
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& ours,
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& theirs,
+    Resolver resolver) {
+  typedef map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual> map_type;
+  typedef internal::
+      map_traits<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>
+          traits;
+  assert(ancestor.provider() == ours.provider());
+  assert(ancestor.provider() == theirs.provider());
+  internal::env<traits> env(ancestor.provider().get());
+  internal::three_way_merge<traits, Resolver> merge(
+      env, internal::access::rank<map_type>(), resolver);
+  return internal::access::make<map_type>(
+      ancestor.provider(),
+      merge(internal::root_cursor(internal::access::node(ancestor)),
+            internal::root_cursor(internal::access::node(ours)),
+            internal::root_cursor(internal::access::node(theirs)), nullptr,
+            nullptr));
+}
+
+/**
+ * Returns the changes from one map to another, in key order.
+ *
+ * for (const auto& c : diff(old_version, new_version)) { ... }
+ *
+ * Keys that are mapped to different values in the two maps are reported as
+ * changed.
+ *
+ * Result is undefined if not both maps are using the same map_provider.
+ *
+ * @param from the old version
+ * @param to the new version
+ * @return a range of changes
+ *
+ * Let n be the size of the larger map.
+ * Let d be the size of the difference between the maps.
+ *
+ * Complexity: O(d * log(n/d)) expected time for the whole iteration and
+ * O(log n) expected memory.
+ **/
+template <class Key,
+          class T,
+          class Compare,
+          class Hash,
+          class Equal,
+          class MappedHash,
+          class MappedEqual>
+diff_range<
+    internal::map_traits<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>>
+diff(const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& from,
+     const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& to) {
+  return {from, to};
+}
+
+/**
+ * Returns the size of the intersection of two maps, without creating it.
+ *
+ * Elements are counted if both maps contain equal elements with the same key,
+ * as for lhs & rhs.
+ *
+ * Result is undefined if not both maps are using the same map_provider.
+ *
+ * Let n be the size of the larger map.
+ * Let m be the size of the smaller map.
+ * Let d be the size of the difference between the maps.
+ *
+ * Complexity: O(min(m * log(n/m), d * log(n/d))) expected time and
+ * O(log n) expected memory.
+ **/
+template <class Key,
+          class T,
+          class Compare,
+          class Hash,
+          class Equal,
+          class MappedHash,
+          class MappedEqual>
+size_t intersection_size(
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& lhs,
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& rhs) {
+  typedef map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual> map_type;
+  typedef internal::
+      map_traits<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>
+          traits;
+  assert(lhs.provider() == rhs.provider());
+  internal::env<traits> env(lhs.provider().get());
+  return internal::intersection_size(env, internal::access::rank<map_type>(),
+                                     internal::access::node(lhs),
+                                     internal::access::node(rhs));
+}
+
+/**
+ * Returns the size of the difference of two maps, without creating it.
+ *
+ * Result is undefined if not both maps are using the same map_provider.
+ *
+ * Complexity: Same as intersection_size(lhs, rhs).
+ **/
+template <class Key,
+          class T,
+          class Compare,
+          class Hash,
+          class Equal,
+          class MappedHash,
+          class MappedEqual>
+size_t difference_size(
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& lhs,
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& rhs) {
+  return lhs.size() - intersection_size(lhs, rhs);
+}
+
+/**
+ * Returns the size of the union of two maps, without creating it.
+ *
+ * Elements are unique with respect to keys, as for lhs | rhs.
+ *
+ * Result is undefined if not both maps are using the same map_provider.
+ *
+ * Complexity: Same as intersection_size(lhs, rhs).
+ **/
+template <class Key,
+          class T,
+          class Compare,
+          class Hash,
+          class Equal,
+          class MappedHash,
+          class MappedEqual>
+size_t union_size(
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& lhs,
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& rhs) {
+  typedef internal::
+      map_traits<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>
+          traits;
+  assert(lhs.provider() == rhs.provider());
+  internal::env<traits> env(lhs.provider().get());
+  return lhs.size() + rhs.size() -
+         internal::intersection_size(env, &internal::rank<traits>,
+                                     internal::access::node(lhs),
+                                     internal::access::node(rhs));
+}
+
 }  // namespace confluent
 
 #endif  // CONFLUENT_MAP_H_INCLUDED
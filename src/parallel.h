@@ -0,0 +1,981 @@
+/*
+ * Copyright (c) 2017 Olle Liljenzin
+ */
+
+#ifndef CONFLUENT_PARALLEL_H_INCLUDED
+#define CONFLUENT_PARALLEL_H_INCLUDED
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <thread>
+
+#include "map.h"
+#include "set.h"
+
+namespace confluent {
+
+/// @cond HIDDEN_SYMBOLS
+
+class fork_join_policy;
+
+namespace internal {
+
+template <class Traits>
+struct fork_join_run;
+
+struct fork_join_task {
+  fork_join_task() : done_(false) {}
+
+  virtual ~fork_join_task() {}
+
+  virtual void execute() = 0;
+
+  void run() {
+    try {
+      execute();
+    } catch (...) {
+      error_ = std::current_exception();
+    }
+    done_.store(true, std::memory_order_release);
+  }
+
+  bool done() const { return done_.load(std::memory_order_acquire); }
+
+  std::atomic<bool> done_;
+  std::exception_ptr error_;
+};
+
+template <class Function>
+struct fork_join_closure : fork_join_task {
+  fork_join_closure(Function function) : function_(std::move(function)) {}
+
+  void execute() override { function_(); }
+
+  Function function_;
+};
+
+// A work-stealing thread pool for fork-join parallelism.
+//
+// Every participating thread owns a deque of forked tasks. Owners push and pop
+// tasks at the back of their deques, while idle threads steal the oldest
+// tasks, which represent the largest subproblems, from the front of other
+// deques. Threads that call into the pool from outside participate with
+// temporary deques while they wait for their tasks.
+class fork_join_pool {
+ public:
+  struct worker_deque {
+    std::mutex mutex_;
+    std::deque<fork_join_task*> tasks_;
+  };
+
+  struct participant {
+    fork_join_pool* pool_;
+    worker_deque* deque_;
+  };
+
+  // Registers the calling thread as participant while in scope.
+  class scope {
+   public:
+    scope(fork_join_pool& pool) : pool_(pool), saved_(current()) {
+      if (!saved_ || saved_->pool_ != &pool_) {
+        registered_.reset(new participant{&pool_, new worker_deque()});
+        pool_.add(registered_->deque_);
+        current() = registered_.get();
+      }
+    }
+
+    scope(const scope&) = delete;
+
+    ~scope() {
+      if (registered_) {
+        current() = saved_;
+        pool_.remove(registered_->deque_);
+        delete registered_->deque_;
+      }
+    }
+
+   private:
+    fork_join_pool& pool_;
+    participant* const saved_;
+    std::unique_ptr<participant> registered_;
+  };
+
+  explicit fork_join_pool(size_t concurrency)
+      : concurrency_(std::max<size_t>(concurrency, 1)),
+        queued_(0),
+        sleepers_(0),
+        stop_(false) {
+    for (size_t i = 1; i < concurrency_; ++i) {
+      worker_deque* deque = new worker_deque();
+      add(deque);
+      threads_.emplace_back([this, deque] { work(deque); });
+    }
+  }
+
+  fork_join_pool(const fork_join_pool&) = delete;
+
+  ~fork_join_pool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      stop_ = true;
+    }
+    sleep_cv_.notify_all();
+    for (std::thread& thread : threads_)
+      thread.join();
+    for (worker_deque* deque : deques_)
+      delete deque;
+  }
+
+  size_t concurrency() const { return concurrency_; }
+
+  // Makes a task available for other threads. Must be called within a scope.
+  void fork(fork_join_task* task) {
+    worker_deque* deque = current()->deque_;
+    {
+      std::lock_guard<std::mutex> lock(deque->mutex_);
+      deque->tasks_.push_back(task);
+    }
+    queued_.fetch_add(1);
+    if (sleepers_.load() > 0) {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      sleep_cv_.notify_one();
+    }
+  }
+
+  // Waits for a forked task, running it directly if it has not been stolen
+  // and helping with other tasks otherwise.
+  void join(fork_join_task* task) {
+    worker_deque* deque = current()->deque_;
+    {
+      std::unique_lock<std::mutex> lock(deque->mutex_);
+      if (!deque->tasks_.empty() && deque->tasks_.back() == task) {
+        deque->tasks_.pop_back();
+        lock.unlock();
+        queued_.fetch_sub(1);
+        task->run();
+      }
+    }
+    while (!task->done()) {
+      if (fork_join_task* other = steal(deque))
+        other->run();
+      else
+        std::this_thread::yield();
+    }
+    if (task->error_)
+      std::rethrow_exception(task->error_);
+  }
+
+ private:
+  // The participant the calling thread is registered as, if any.
+  static participant*& current() {
+    static thread_local participant* current = nullptr;
+    return current;
+  }
+
+  void add(worker_deque* deque) {
+    std::lock_guard<std::mutex> lock(deques_mutex_);
+    deques_.push_back(deque);
+  }
+
+  void remove(worker_deque* deque) {
+    std::lock_guard<std::mutex> lock(deques_mutex_);
+    deques_.erase(std::find(deques_.begin(), deques_.end(), deque));
+  }
+
+  // Takes the oldest task from another deque.
+  fork_join_task* steal(worker_deque* self) {
+    if (queued_.load() == 0)
+      return nullptr;
+    std::lock_guard<std::mutex> lock(deques_mutex_);
+    size_t n = deques_.size();
+    size_t start = std::hash<std::thread::id>()(std::this_thread::get_id());
+    for (size_t i = 0; i < n; ++i) {
+      worker_deque* victim = deques_[(start + i) % n];
+      if (victim == self)
+        continue;
+      std::lock_guard<std::mutex> victim_lock(victim->mutex_);
+      if (!victim->tasks_.empty()) {
+        fork_join_task* task = victim->tasks_.front();
+        victim->tasks_.pop_front();
+        queued_.fetch_sub(1);
+        return task;
+      }
+    }
+    return nullptr;
+  }
+
+  void work(worker_deque* deque) {
+    participant self = {this, deque};
+    current() = &self;
+    while (true) {
+      if (fork_join_task* task = steal(deque)) {
+        task->run();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      sleepers_.fetch_add(1);
+      while (!stop_ && queued_.load() == 0)
+        sleep_cv_.wait(lock);
+      sleepers_.fetch_sub(1);
+      if (stop_)
+        break;
+    }
+    current() = nullptr;
+  }
+
+  const size_t concurrency_;
+  std::vector<std::thread> threads_;
+  std::mutex deques_mutex_;
+  std::vector<worker_deque*> deques_;
+  std::atomic<size_t> queued_;
+  std::atomic<size_t> sleepers_;
+  std::mutex sleep_mutex_;
+  std::condition_variable sleep_cv_;
+  bool stop_;
+};
+
+template <class Traits>
+struct fork_context {
+  const env<Traits>& env_;
+  typename Traits::provider* const provider_;
+  fork_join_pool& pool_;
+  const size_t grain_;
+};
+
+// Runs two functions that return nodes, the second one as a forked task that
+// may be stolen by another thread.
+template <class Traits, class First, class Second>
+std::pair<node_ptr<Traits>, node_ptr<Traits>> fork_join(
+    const fork_context<Traits>& ctx,
+    First first,
+    Second second) {
+  node_ptr<Traits> second_result;
+  auto function = [&] {
+    env<Traits> local_env(ctx.provider_);
+    second_result = second();
+  };
+  fork_join_closure<decltype(function)> task(function);
+  ctx.pool_.fork(&task);
+  node_ptr<Traits> first_result;
+  try {
+    first_result = first();
+  } catch (...) {
+    // The forked task refers to the caller's frame and must complete first.
+    try {
+      ctx.pool_.join(&task);
+    } catch (...) {
+    }
+    throw;
+  }
+  ctx.pool_.join(&task);
+  return {std::move(first_result), std::move(second_result)};
+}
+
+template <class Traits, class Left, class Right>
+bool below_grain(const fork_context<Traits>& ctx,
+                 const Left& left,
+                 const Right& right) {
+  return size(left) + size(right) < ctx.grain_;
+}
+
+template <class Traits, class Left, class Right>
+node_ptr<Traits> set_union(const fork_context<Traits>& ctx,
+                           Left&& left,
+                           Right&& right) {
+  const env<Traits>& env = ctx.env_;
+  if (below_grain(ctx, left, right))
+    return set_union(env, std::forward<Left>(left), std::forward<Right>(right));
+  if (left == right || !right)
+    return std::forward<Left>(left);
+  if (!left)
+    return std::forward<Right>(right);
+  switch (rank(env, *left, *right)) {
+    case ranking::LEFT: {
+      auto s = split(env, std::forward<Right>(right), left->key());
+      auto r = fork_join(
+          ctx, [&] { return set_union(ctx, left->left_, std::move(s.first)); },
+          [&] { return set_union(ctx, left->right_, std::move(s.second)); });
+      return make_node(env, *left, std::move(r.first), std::move(r.second));
+    }
+    case ranking::RIGHT: {
+      auto s = split(env, std::forward<Left>(left), right->key());
+      auto r = fork_join(
+          ctx, [&] { return set_union(ctx, std::move(s.first), right->left_); },
+          [&] { return set_union(ctx, std::move(s.second), right->right_); });
+      return make_node(env, *right, std::move(r.first), std::move(r.second));
+    }
+    default: {
+      auto r = fork_join(
+          ctx, [&] { return set_union(ctx, left->left_, right->left_); },
+          [&] { return set_union(ctx, left->right_, right->right_); });
+      return make_node(env, *left, std::move(r.first), std::move(r.second));
+    }
+  }
+}
+
+template <class Traits, class Rank, class Left, class Right>
+node_ptr<Traits> set_intersection(const fork_context<Traits>& ctx,
+                                  Rank ranker,
+                                  Left&& left,
+                                  Right&& right) {
+  const env<Traits>& env = ctx.env_;
+  if (below_grain(ctx, left, right))
+    return set_intersection(env, ranker, std::forward<Left>(left),
+                            std::forward<Right>(right));
+  if (!left || !right)
+    return nullptr;
+  if (left == right)
+    return std::forward<Left>(left);
+  switch (ranker(env, *left, *right)) {
+    case ranking::LEFT: {
+      auto s = split(env, std::forward<Right>(right), left->key());
+      auto r = fork_join(ctx,
+                         [&] {
+                           return set_intersection(ctx, ranker, left->left_,
+                                                   std::move(s.first));
+                         },
+                         [&] {
+                           return set_intersection(ctx, ranker, left->right_,
+                                                   std::move(s.second));
+                         });
+      return join(env, std::move(r.first), std::move(r.second));
+    }
+    case ranking::RIGHT: {
+      auto s = split(env, std::forward<Left>(left), right->key());
+      auto r = fork_join(ctx,
+                         [&] {
+                           return set_intersection(ctx, ranker,
+                                                   std::move(s.first),
+                                                   right->left_);
+                         },
+                         [&] {
+                           return set_intersection(ctx, ranker,
+                                                   std::move(s.second),
+                                                   right->right_);
+                         });
+      return join(env, std::move(r.first), std::move(r.second));
+    }
+    case ranking::NOT_SAME: {
+      auto r = fork_join(ctx,
+                         [&] {
+                           return set_intersection(ctx, ranker, left->left_,
+                                                   right->left_);
+                         },
+                         [&] {
+                           return set_intersection(ctx, ranker, left->right_,
+                                                   right->right_);
+                         });
+      return join(env, std::move(r.first), std::move(r.second));
+    }
+    default: {
+      auto r = fork_join(ctx,
+                         [&] {
+                           return set_intersection(ctx, ranker, left->left_,
+                                                   right->left_);
+                         },
+                         [&] {
+                           return set_intersection(ctx, ranker, left->right_,
+                                                   right->right_);
+                         });
+      return make_node(env, *left, std::move(r.first), std::move(r.second));
+    }
+  }
+}
+
+template <class Traits, class Rank, class Left, class Right>
+node_ptr<Traits> set_difference(const fork_context<Traits>& ctx,
+                                Rank ranker,
+                                Left&& left,
+                                Right&& right) {
+  const env<Traits>& env = ctx.env_;
+  if (below_grain(ctx, left, right))
+    return set_difference(env, ranker, std::forward<Left>(left),
+                          std::forward<Right>(right));
+  if (left == right || !left)
+    return nullptr;
+  if (!right)
+    return std::forward<Left>(left);
+  switch (ranker(env, *left, *right)) {
+    case ranking::LEFT: {
+      auto s = split(env, std::forward<Right>(right), left->key());
+      auto r = fork_join(ctx,
+                         [&] {
+                           return set_difference(ctx, ranker, left->left_,
+                                                 std::move(s.first));
+                         },
+                         [&] {
+                           return set_difference(ctx, ranker, left->right_,
+                                                 std::move(s.second));
+                         });
+      return make_node(env, *left, std::move(r.first), std::move(r.second));
+    }
+    case ranking::RIGHT: {
+      auto s = split(env, std::forward<Left>(left), right->key());
+      auto r = fork_join(ctx,
+                         [&] {
+                           return set_difference(ctx, ranker,
+                                                 std::move(s.first),
+                                                 right->left_);
+                         },
+                         [&] {
+                           return set_difference(ctx, ranker,
+                                                 std::move(s.second),
+                                                 right->right_);
+                         });
+      return join(env, std::move(r.first), std::move(r.second));
+    }
+    case ranking::NOT_SAME: {
+      auto r = fork_join(ctx,
+                         [&] {
+                           return set_difference(ctx, ranker, left->left_,
+                                                 right->left_);
+                         },
+                         [&] {
+                           return set_difference(ctx, ranker, left->right_,
+                                                 right->right_);
+                         });
+      return make_node(env, *left, std::move(r.first), std::move(r.second));
+    }
+    default: {
+      auto r = fork_join(ctx,
+                         [&] {
+                           return set_difference(ctx, ranker, left->left_,
+                                                 right->left_);
+                         },
+                         [&] {
+                           return set_difference(ctx, ranker, left->right_,
+                                                 right->right_);
+                         });
+      return join(env, std::move(r.first), std::move(r.second));
+    }
+  }
+}
+
+template <class Traits, class Left, class Right>
+node_ptr<Traits> set_symmetric(const fork_context<Traits>& ctx,
+                               Left&& left,
+                               Right&& right) {
+  const env<Traits>& env = ctx.env_;
+  if (below_grain(ctx, left, right))
+    return set_symmetric(env, std::forward<Left>(left),
+                         std::forward<Right>(right));
+  if (!left)
+    return std::forward<Right>(right);
+  if (!right)
+    return std::forward<Left>(left);
+  if (left == right)
+    return nullptr;
+  switch (rank(env, *left, *right)) {
+    case ranking::LEFT: {
+      auto s = split(env, std::forward<Right>(right), left->key());
+      auto r = fork_join(
+          ctx,
+          [&] { return set_symmetric(ctx, left->left_, std::move(s.first)); },
+          [&] {
+            return set_symmetric(ctx, left->right_, std::move(s.second));
+          });
+      return make_node(env, *left, std::move(r.first), std::move(r.second));
+    }
+    case ranking::RIGHT: {
+      auto s = split(env, std::forward<Left>(left), right->key());
+      auto r = fork_join(
+          ctx,
+          [&] { return set_symmetric(ctx, std::move(s.first), right->left_); },
+          [&] {
+            return set_symmetric(ctx, std::move(s.second), right->right_);
+          });
+      return make_node(env, *right, std::move(r.first), std::move(r.second));
+    }
+    default: {
+      auto r = fork_join(
+          ctx, [&] { return set_symmetric(ctx, left->left_, right->left_); },
+          [&] { return set_symmetric(ctx, left->right_, right->right_); });
+      return join(env, std::move(r.first), std::move(r.second));
+    }
+  }
+}
+
+// Intersection of a map and a set of keys.
+template <class Traits, class Left, class Right>
+node_ptr<Traits> set_intersection(const fork_context<Traits>& ctx,
+                                  Left&& left,
+                                  Right&& right) {
+  const env<Traits>& env = ctx.env_;
+  if (below_grain(ctx, left, right))
+    return set_intersection(env, std::forward<Left>(left),
+                            std::forward<Right>(right));
+  if (!left || !right)
+    return nullptr;
+  if (left->key_node() == right)
+    return std::forward<Left>(left);
+  switch (rank(env.key_set_env_, *left->key_node(), *right)) {
+    case ranking::LEFT: {
+      auto s = split(env.key_set_env_, std::forward<Right>(right), left->key());
+      auto r = fork_join(
+          ctx,
+          [&] {
+            return set_intersection(ctx, left->left_, std::move(s.first));
+          },
+          [&] {
+            return set_intersection(ctx, left->right_, std::move(s.second));
+          });
+      return join(env, std::move(r.first), std::move(r.second));
+    }
+    case ranking::RIGHT: {
+      auto s = split(env, std::forward<Left>(left), right->key());
+      auto r = fork_join(
+          ctx,
+          [&] {
+            return set_intersection(ctx, std::move(s.first), right->left_);
+          },
+          [&] {
+            return set_intersection(ctx, std::move(s.second), right->right_);
+          });
+      return join(env, std::move(r.first), std::move(r.second));
+    }
+    default: {
+      auto r = fork_join(
+          ctx, [&] { return set_intersection(ctx, left->left_, right->left_); },
+          [&] { return set_intersection(ctx, left->right_, right->right_); });
+      return make_node(env, *left, std::move(r.first), std::move(r.second));
+    }
+  }
+}
+
+// Difference of a map and a set of keys.
+template <class Traits, class Left, class Right>
+node_ptr<Traits> set_difference(const fork_context<Traits>& ctx,
+                                Left&& left,
+                                Right&& right) {
+  const env<Traits>& env = ctx.env_;
+  if (below_grain(ctx, left, right))
+    return set_difference(env, std::forward<Left>(left),
+                          std::forward<Right>(right));
+  if (!left || left->key_node() == right)
+    return nullptr;
+  if (!right)
+    return std::forward<Left>(left);
+  switch (rank(env.key_set_env_, *left->key_node(), *right)) {
+    case ranking::LEFT: {
+      auto s = split(env.key_set_env_, std::forward<Right>(right), left->key());
+      auto r = fork_join(
+          ctx,
+          [&] { return set_difference(ctx, left->left_, std::move(s.first)); },
+          [&] {
+            return set_difference(ctx, left->right_, std::move(s.second));
+          });
+      return make_node(env, *left, std::move(r.first), std::move(r.second));
+    }
+    case ranking::RIGHT: {
+      auto s = split(env, std::forward<Left>(left), right->key());
+      auto r = fork_join(
+          ctx,
+          [&] { return set_difference(ctx, std::move(s.first), right->left_); },
+          [&] {
+            return set_difference(ctx, std::move(s.second), right->right_);
+          });
+      return join(env, std::move(r.first), std::move(r.second));
+    }
+    default: {
+      auto r = fork_join(
+          ctx, [&] { return set_difference(ctx, left->left_, right->left_); },
+          [&] { return set_difference(ctx, left->right_, right->right_); });
+      return join(env, std::move(r.first), std::move(r.second));
+    }
+  }
+}
+
+}  // namespace internal
+
+/// @endcond HIDDEN_SYMBOLS
+
+/**
+ * A fork_join_policy runs merge operations in parallel on a pool of worker
+ * threads.
+ *
+ * The merge algorithms divide their inputs into two independent subproblems
+ * at every level of recursion. Subproblems whose combined input size is at
+ * least the grain size are forked as tasks that idle threads can steal, while
+ * smaller subproblems are merged sequentially by the thread that reached them.
+ *
+ * Results are identical to the results of the sequential operations and share
+ * nodes with all other containers using the same provider. Providers used in
+ * parallel operations should be created with a concurrency option that matches
+ * the number of threads in the policy.
+ *
+ * A fork_join_policy can be shared by any number of threads and used with
+ * containers of any type.
+ **/
+class fork_join_policy {
+  template <class Traits>
+  friend struct internal::fork_join_run;
+
+ public:
+  /**
+   * Constructs a new fork_join_policy.
+   *
+   * @param concurrency the number of threads that participate in parallel
+   *     operations, including the calling thread
+   * @param grain the smallest combined input size that is forked
+   **/
+  explicit fork_join_policy(
+      size_t concurrency = std::thread::hardware_concurrency(),
+      size_t grain = 1 << 12)
+      : pool_(new internal::fork_join_pool(concurrency)),
+        grain_(std::max<size_t>(grain, 1)) {}
+
+  fork_join_policy(const fork_join_policy&) = delete;
+
+  /**
+   * Returns the number of threads that participate in parallel operations.
+   **/
+  size_t concurrency() const { return pool_->concurrency(); }
+
+  /**
+   * Returns the smallest combined input size that is forked.
+   **/
+  size_t grain() const { return grain_; }
+
+  /**
+   * Returns the default instance, which uses all hardware threads.
+   **/
+  static const fork_join_policy& default_policy() {
+    static const fork_join_policy policy;
+    return policy;
+  }
+
+ private:
+  const std::unique_ptr<internal::fork_join_pool> pool_;
+  const size_t grain_;
+};
+
+/// @cond HIDDEN_SYMBOLS
+
+namespace internal {
+
+// State of a parallel operation on the calling thread.
+template <class Traits>
+struct fork_join_run {
+  fork_join_run(const fork_join_policy& policy,
+                typename Traits::provider* provider)
+      : env_(provider),
+        scope_(*policy.pool_),
+        context_{env_, provider, *policy.pool_, policy.grain_} {}
+
+  const env<Traits> env_;
+  fork_join_pool::scope scope_;
+  const fork_context<Traits> context_;
+};
+
+}  // namespace internal
+
+/// @endcond HIDDEN_SYMBOLS
+
+/**
+ * Returns the union of two sets, computed in parallel.
+ *
+ * Result is undefined if not both sets are using the same set_provider.
+ *
+ * @param policy policy that runs the operation
+ * @param lhs set to merge
+ * @param rhs other set to merge
+ * @return a set containing all elements in lhs and in rhs
+ *
+ * Complexity: Same as lhs | rhs, shared among the threads of the policy.
+ **/
+template <class T, class Compare, class Hash, class Equal>
+set<T, Compare, Hash, Equal> set_union(
+    const fork_join_policy& policy,
+    const set<T, Compare, Hash, Equal>& lhs,
+    const set<T, Compare, Hash, Equal>& rhs) {
+  typedef set<T, Compare, Hash, Equal> set_type;
+  typedef internal::set_traits<T, Compare, Hash, Equal> traits;
+  assert(lhs.provider() == rhs.provider());
+  internal::fork_join_run<traits> run(policy, lhs.provider().get());
+  return internal::access::make<set_type>(
+      lhs.provider(),
+      internal::set_union(run.context_, internal::access::node(lhs),
+                          internal::access::node(rhs)));
+}
+
+/**
+ * Returns the intersection of two sets, computed in parallel.
+ *
+ * Result is undefined if not both sets are using the same set_provider.
+ *
+ * @param policy policy that runs the operation
+ * @param lhs set to merge
+ * @param rhs other set to merge
+ * @return a set containing the elements in lhs that are also in rhs
+ *
+ * Complexity: Same as lhs & rhs, shared among the threads of the policy.
+ **/
+template <class T, class Compare, class Hash, class Equal>
+set<T, Compare, Hash, Equal> set_intersection(
+    const fork_join_policy& policy,
+    const set<T, Compare, Hash, Equal>& lhs,
+    const set<T, Compare, Hash, Equal>& rhs) {
+  typedef set<T, Compare, Hash, Equal> set_type;
+  typedef internal::set_traits<T, Compare, Hash, Equal> traits;
+  assert(lhs.provider() == rhs.provider());
+  internal::fork_join_run<traits> run(policy, lhs.provider().get());
+  return internal::access::make<set_type>(
+      lhs.provider(),
+      internal::set_intersection(run.context_, &internal::rank<traits>,
+                                 internal::access::node(lhs),
+                                 internal::access::node(rhs)));
+}
+
+/**
+ * Returns the difference of two sets, computed in parallel.
+ *
+ * Result is undefined if not both sets are using the same set_provider.
+ *
+ * @param policy policy that runs the operation
+ * @param lhs set to merge
+ * @param rhs other set to merge
+ * @return a set containing the elements in lhs that are not in rhs
+ *
+ * Complexity: Same as lhs - rhs, shared among the threads of the policy.
+ **/
+template <class T, class Compare, class Hash, class Equal>
+set<T, Compare, Hash, Equal> set_difference(
+    const fork_join_policy& policy,
+    const set<T, Compare, Hash, Equal>& lhs,
+    const set<T, Compare, Hash, Equal>& rhs) {
+  typedef set<T, Compare, Hash, Equal> set_type;
+  typedef internal::set_traits<T, Compare, Hash, Equal> traits;
+  assert(lhs.provider() == rhs.provider());
+  internal::fork_join_run<traits> run(policy, lhs.provider().get());
+  return internal::access::make<set_type>(
+      lhs.provider(),
+      internal::set_difference(run.context_, &internal::rank<traits>,
+                               internal::access::node(lhs),
+                               internal::access::node(rhs)));
+}
+
+/**
+ * Returns the symmetric difference of two sets, computed in parallel.
+ *
+ * Result is undefined if not both sets are using the same set_provider.
+ *
+ * @param policy policy that runs the operation
+ * @param lhs set to merge
+ * @param rhs other set to merge
+ * @return a set containing the elements that are in exactly one of lhs and
+ *     rhs
+ *
+ * Complexity: Same as lhs ^ rhs, shared among the threads of the policy.
+ **/
+template <class T, class Compare, class Hash, class Equal>
+set<T, Compare, Hash, Equal> set_symmetric_difference(
+    const fork_join_policy& policy,
+    const set<T, Compare, Hash, Equal>& lhs,
+    const set<T, Compare, Hash, Equal>& rhs) {
+  typedef set<T, Compare, Hash, Equal> set_type;
+  typedef internal::set_traits<T, Compare, Hash, Equal> traits;
+  assert(lhs.provider() == rhs.provider());
+  internal::fork_join_run<traits> run(policy, lhs.provider().get());
+  return internal::access::make<set_type>(
+      lhs.provider(),
+      internal::set_symmetric(run.context_, internal::access::node(lhs),
+                              internal::access::node(rhs)));
+}
+
+/**
+ * Returns the union of two maps, computed in parallel.
+ *
+ * Elements are unique with respect to keys, with precedence for elements from
+ * lhs.
+ *
+ * Result is undefined if not both maps are using the same map_provider.
+ *
+ * @param policy policy that runs the operation
+ * @param lhs map to merge
+ * @param rhs other map to merge
+ * @return a map containing all elements in lhs and in rhs
+ *
+ * Complexity: Same as lhs | rhs, shared among the threads of the policy.
+ **/
+template <class Key,
+          class T,
+          class Compare,
+          class Hash,
+          class Equal,
+          class MappedHash,
+          class MappedEqual>
+map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual> set_union(
+    const fork_join_policy& policy,
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& lhs,
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& rhs) {
+  typedef map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual> map_type;
+  typedef internal::
+      map_traits<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>
+          traits;
+  assert(lhs.provider() == rhs.provider());
+  internal::fork_join_run<traits> run(policy, lhs.provider().get());
+  return internal::access::make<map_type>(
+      lhs.provider(),
+      internal::set_union(run.context_, internal::access::node(lhs),
+                          internal::access::node(rhs)));
+}
+
+/**
+ * Returns the intersection of two maps, computed in parallel.
+ *
+ * Both keys and mapped values are matched.
+ *
+ * Result is undefined if not both maps are using the same map_provider.
+ *
+ * @param policy policy that runs the operation
+ * @param lhs map to merge
+ * @param rhs other map to merge
+ * @return a map containing the elements in lhs that are also in rhs
+ *
+ * Complexity: Same as lhs & rhs, shared among the threads of the policy.
+ **/
+template <class Key,
+          class T,
+          class Compare,
+          class Hash,
+          class Equal,
+          class MappedHash,
+          class MappedEqual>
+map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual> set_intersection(
+    const fork_join_policy& policy,
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& lhs,
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& rhs) {
+  typedef map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual> map_type;
+  typedef internal::
+      map_traits<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>
+          traits;
+  assert(lhs.provider() == rhs.provider());
+  internal::fork_join_run<traits> run(policy, lhs.provider().get());
+  return internal::access::make<map_type>(
+      lhs.provider(),
+      internal::set_intersection(run.context_,
+                                 internal::access::rank<map_type>(),
+                                 internal::access::node(lhs),
+                                 internal::access::node(rhs)));
+}
+
+/**
+ * Returns the intersection of a map and a set, computed in parallel.
+ *
+ * Only keys are matched.
+ *
+ * Result is undefined if not the given set is using the same set_provider as
+ * the key set of the map.
+ *
+ * @param policy policy that runs the operation
+ * @param lhs map to merge
+ * @param rhs set to merge
+ * @return a map containing the elements in lhs whose keys are in rhs
+ *
+ * Complexity: Same as lhs & rhs, shared among the threads of the policy.
+ **/
+template <class Key,
+          class T,
+          class Compare,
+          class Hash,
+          class Equal,
+          class MappedHash,
+          class MappedEqual>
+map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual> set_intersection(
+    const fork_join_policy& policy,
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& lhs,
+    const set<Key, Compare, Hash, Equal>& rhs) {
+  typedef map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual> map_type;
+  typedef internal::
+      map_traits<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>
+          traits;
+  assert(lhs.provider()->set_provider() == rhs.provider());
+  internal::fork_join_run<traits> run(policy, lhs.provider().get());
+  return internal::access::make<map_type>(
+      lhs.provider(),
+      internal::set_intersection(run.context_, internal::access::node(lhs),
+                                 internal::access::node(rhs)));
+}
+
+/**
+ * Returns the difference of two maps, computed in parallel.
+ *
+ * Both keys and mapped values are matched.
+ *
+ * Result is undefined if not both maps are using the same map_provider.
+ *
+ * @param policy policy that runs the operation
+ * @param lhs map to merge
+ * @param rhs other map to merge
+ * @return a map containing the elements in lhs that are not in rhs
+ *
+ * Complexity: Same as lhs - rhs, shared among the threads of the policy.
+ **/
+template <class Key,
+          class T,
+          class Compare,
+          class Hash,
+          class Equal,
+          class MappedHash,
+          class MappedEqual>
+map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual> set_difference(
+    const fork_join_policy& policy,
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& lhs,
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& rhs) {
+  typedef map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual> map_type;
+  typedef internal::
+      map_traits<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>
+          traits;
+  assert(lhs.provider() == rhs.provider());
+  internal::fork_join_run<traits> run(policy, lhs.provider().get());
+  return internal::access::make<map_type>(
+      lhs.provider(),
+      internal::set_difference(run.context_,
+                               internal::access::rank<map_type>(),
+                               internal::access::node(lhs),
+                               internal::access::node(rhs)));
+}
+
+/**
+ * Returns the difference of a map and a set, computed in parallel.
+ *
+ * Only keys are matched.
+ *
+ * Result is undefined if not the given set is using the same set_provider as
+ * the key set of the map.
+ *
+ * @param policy policy that runs the operation
+ * @param lhs map to merge
+ * @param rhs set to merge
+ * @return a map containing the elements in lhs whose keys are not in rhs
+ *
+ * Complexity: Same as lhs - rhs, shared among the threads of the policy.
+ **/
+template <class Key,
+          class T,
+          class Compare,
+          class Hash,
+          class Equal,
+          class MappedHash,
+          class MappedEqual>
+map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual> set_difference(
+    const fork_join_policy& policy,
+    const map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>& lhs,
+    const set<Key, Compare, Hash, Equal>& rhs) {
+  typedef map<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual> map_type;
+  typedef internal::
+      map_traits<Key, T, Compare, Hash, Equal, MappedHash, MappedEqual>
+          traits;
+  assert(lhs.provider()->set_provider() == rhs.provider());
+  internal::fork_join_run<traits> run(policy, lhs.provider().get());
+  return internal::access::make<map_type>(
+      lhs.provider(),
+      internal::set_difference(run.context_, internal::access::node(lhs),
+                               internal::access::node(rhs)));
+}
+
+}  // namespace confluent
+
+#endif  // CONFLUENT_PARALLEL_H_INCLUDED
@@ -0,0 +1,586 @@
+/*
+ * Copyright (c) 2017 Olle Liljenzin
+ */
+
+#ifndef CONFLUENT_SERIALIZE_H_INCLUDED
+#define CONFLUENT_SERIALIZE_H_INCLUDED
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "map.h"
+#include "set.h"
+
+namespace confluent {
+
+/// @cond HIDDEN_SYMBOLS
+
+namespace internal {
+
+// Integers are written as 8 bytes in little endian order.
+template <class Stream>
+void write_uint64(Stream& stream, std::uint64_t value) {
+  char bytes[8];
+  for (size_t i = 0; i < 8; ++i)
+    bytes[i] = static_cast<char>(value >> (8 * i));
+  stream.write(bytes, 8);
+}
+
+template <class Stream>
+std::uint64_t read_uint64(Stream& stream) {
+  char bytes[8];
+  stream.read(bytes, 8);
+  std::uint64_t value = 0;
+  for (size_t i = 0; i < 8; ++i)
+    value |= std::uint64_t(static_cast<unsigned char>(bytes[i])) << (8 * i);
+  return value;
+}
+
+// Writes trees as records of a node table, in which every distinct node is
+// written once, after its children. Nodes are identified by their position in
+// the table, starting from 1, and 0 identifies the empty tree.
+template <class Traits, class Codec>
+class node_table_writer {
+ public:
+  node_table_writer() : size_(0) {}
+
+  // Writes the nodes of a tree that are not already written and returns the
+  // id of its root.
+  template <class Stream>
+  std::uint64_t write(Stream& stream, const node_ptr<Traits>& p) {
+    if (!p)
+      return 0;
+    auto it = ids_.find(p.get());
+    if (it != ids_.end())
+      return it->second.second;
+    std::uint64_t left = write(stream, p->left_);
+    std::uint64_t right = write(stream, p->right_);
+    const char record = 'N';
+    stream.write(&record, 1);
+    write_uint64(stream, left);
+    write_uint64(stream, right);
+    Codec::write(stream, p->value());
+    return add(p);
+  }
+
+  // Assigns the next id to a node that is already written, e.g. a node read
+  // back from a table that is appended to, and returns the id.
+  std::uint64_t add(const node_ptr<Traits>& p) {
+    ids_.emplace(p.get(), std::make_pair(p, ++size_));
+    return size_;
+  }
+
+  // Number of written nodes.
+  size_t size() const { return size_; }
+
+  // Forgets the written nodes. Must be called with an env.
+  void clear() {
+    ids_.clear();
+    size_ = 0;
+  }
+
+ private:
+  // Written nodes are kept alive so that node addresses are not reused.
+  std::unordered_map<const node<Traits>*,
+                     std::pair<node_ptr<Traits>, std::uint64_t>>
+      ids_;
+  std::uint64_t size_;
+};
+
+// Reads node records written by a node_table_writer and rebuilds the nodes
+// in a provider. Each node is created from its value and its already created
+// children, so the table is read in linear time without sorting. Corrupt input
+// is rejected by checking each node against the largest key of its left
+// subtree and the smallest key of its right subtree, which are remembered for
+// every read node, and by checking that it ranks above its children.
+template <class Traits, class Codec>
+class node_table_reader {
+ public:
+  template <class Stream>
+  void read(const env<Traits>& env, Stream& stream) {
+    std::uint64_t left = read_uint64(stream);
+    std::uint64_t right = read_uint64(stream);
+    typename Traits::value_type value = Codec::read(stream);
+    const node_ptr<Traits>& l = node(left);
+    const node_ptr<Traits>& r = node(right);
+    if ((l && !env.compare(extremes_[left - 1].second->key(),
+                           key_of(env, value))) ||
+        (r && !env.compare(key_of(env, value),
+                           extremes_[right - 1].first->key())))
+      throw std::runtime_error("corrupt node table");
+    node_ptr<Traits> p = make_node(env, value, l, r);
+    if ((l && rank(env, *p, *l) != ranking::LEFT) ||
+        (r && rank(env, *p, *r) != ranking::LEFT))
+      throw std::runtime_error("corrupt node table");
+    extremes_.emplace_back(l ? extremes_[left - 1].first : p.get(),
+                           r ? extremes_[right - 1].second : p.get());
+    nodes_.push_back(std::move(p));
+  }
+
+  // Returns the node with a given id.
+  const node_ptr<Traits>& node(std::uint64_t id) const {
+    static const node_ptr<Traits> empty;
+    if (id > nodes_.size())
+      throw std::runtime_error("corrupt node table");
+    return id ? nodes_[id - 1] : empty;
+  }
+
+  // Number of read nodes.
+  size_t size() const { return nodes_.size(); }
+
+  // Drops the nodes read after the first n nodes. Must be called with an env.
+  void truncate(size_t n) {
+    nodes_.resize(std::min(n, nodes_.size()));
+    extremes_.resize(nodes_.size());
+  }
+
+  // Drops the read nodes. Must be called with an env.
+  void clear() {
+    nodes_.clear();
+    extremes_.clear();
+  }
+
+ private:
+  std::vector<node_ptr<Traits>> nodes_;
+  // The leftmost and the rightmost node of the subtree of each read node.
+  std::vector<std::pair<const internal::node<Traits>*,
+                        const internal::node<Traits>*>>
+      extremes_;
+};
+
+}  // namespace internal
+
+/// @endcond
+
+/**
+ * Encodes values to a byte stream and decodes them back.
+ *
+ * The primary template writes the object representation of trivially copyable
+ * types, which requires both ends of a stream to use the same data layout.
+ * Specializations are provided for std::string and std::pair, and other value
+ * types are supported by specializing the template with the same members.
+ *
+ * @tparam T type of encoded values
+ **/
+template <class T>
+struct codec {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "codec<T> must be specialized for T");
+
+  /**
+   * Writes a value to a stream.
+   **/
+  template <class Stream>
+  static void write(Stream& stream, const T& value) {
+    stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  /**
+   * Reads a value from a stream.
+   **/
+  template <class Stream>
+  static T read(Stream& stream) {
+    T value;
+    stream.read(reinterpret_cast<char*>(&value), sizeof(T));
+    return value;
+  }
+};
+
+/// @cond HIDDEN_SYMBOLS
+
+template <>
+struct codec<std::string> {
+  template <class Stream>
+  static void write(Stream& stream, const std::string& value) {
+    internal::write_uint64(stream, value.size());
+    stream.write(value.data(), value.size());
+  }
+
+  template <class Stream>
+  static std::string read(Stream& stream) {
+    std::string value(internal::read_uint64(stream), '\0');
+    if (!value.empty())
+      stream.read(&value[0], value.size());
+    return value;
+  }
+};
+
+template <class First, class Second>
+struct codec<std::pair<First, Second>> {
+  template <class Stream>
+  static void write(Stream& stream, const std::pair<First, Second>& value) {
+    codec<First>::write(stream, value.first);
+    codec<Second>::write(stream, value.second);
+  }
+
+  template <class Stream>
+  static std::pair<First, Second> read(Stream& stream) {
+    First first = codec<First>::read(stream);
+    return {std::move(first), codec<Second>::read(stream)};
+  }
+};
+
+/// @endcond
+
+/**
+ * Writes a group of containers to a stream.
+ *
+ * Nodes shared by the containers, or within a container, are written once,
+ * so a history of versions of a container is written in space proportional
+ * to the changes between the versions rather than to the sum of their sizes.
+ * The archive is a table of the distinct nodes, each written with the ids of
+ * its children and its value encoded by codec<value_type>, followed by the
+ * ids of the roots of the containers.
+ *
+ * The stream is any object with the member:
+ *
+ * void write(const char* s, size_t n);  // writes n bytes
+ *
+ * which includes std::ostream.
+ *
+ * Result is undefined if not all containers are using the same provider.
+ *
+ * @param stream stream to write to
+ * @param first iterator to the first container
+ * @param last iterator past the last container
+ *
+ * Let m be the number of distinct nodes in the containers.
+ *
+ * Complexity: O(m) expected time and memory.
+ **/
+template <class Stream, class InputIterator>
+void save(Stream& stream, InputIterator first, InputIterator last) {
+  typedef typename std::iterator_traits<InputIterator>::value_type container;
+  typedef typename internal::access::traits<container>::type traits;
+  static const char header[4] = {'C', 'F', 'A', '1'};
+  static const char roots_record = 'R';
+  std::vector<std::uint64_t> roots;
+  stream.write(header, sizeof(header));
+  if (first != last) {
+    auto provider = first->provider();
+    internal::env<traits> env(provider.get());
+    internal::node_table_writer<traits, codec<typename container::value_type>>
+        writer;
+    for (; first != last; ++first) {
+      assert(first->provider() == provider);
+      roots.push_back(writer.write(stream, internal::access::node(*first)));
+    }
+  }
+  stream.write(&roots_record, 1);
+  internal::write_uint64(stream, roots.size());
+  for (std::uint64_t root : roots)
+    internal::write_uint64(stream, root);
+}
+
+/**
+ * Writes a container to a stream.
+ *
+ * Same as writing a group containing a single container.
+ *
+ * @param stream stream to write to
+ * @param container the container to write
+ *
+ * Let n be the size of the container.
+ *
+ * Complexity: O(n) expected time and memory.
+ **/
+template <class Stream, class Container>
+void save(Stream& stream, const Container& container) {
+  save(stream, &container, &container + 1);
+}
+
+/**
+ * Reads a group of containers written by save().
+ *
+ * Every node is rebuilt once from its value and its children, without sorting,
+ * so the containers share nodes as when they were written. Nodes equal to
+ * nodes already in the provider are shared with them. Each element is compared
+ * with at most two other elements to validate the order of the keys.
+ *
+ * Both ends must use hash functors that return the same values, since the
+ * priorities of the nodes are computed from the hash values of the keys.
+ *
+ * The stream is any object with the member:
+ *
+ * void read(char* s, size_t n);  // reads n bytes
+ *
+ * which includes std::istream. Reads must throw if the stream fails, which
+ * std::istream does with exceptions enabled by stream.exceptions(). Throws
+ * std::runtime_error if the archive is not valid.
+ *
+ * @tparam Container type of the containers
+ * @param stream stream to read from
+ * @param provider provider of the read containers
+ * @return the containers, in the order they were written
+ *
+ * Let m be the number of distinct nodes in the containers.
+ *
+ * Complexity: O(m) expected time and memory.
+ **/
+template <class Container, class Stream>
+std::vector<Container> load(
+    Stream& stream,
+    typename Container::provider_ptr provider =
+        Container::provider_type::default_provider()) {
+  typedef typename internal::access::traits<Container>::type traits;
+  static const char header[4] = {'C', 'F', 'A', '1'};
+  char buffer[4];
+  stream.read(buffer, sizeof(buffer));
+  if (!std::equal(header, header + sizeof(header), buffer))
+    throw std::runtime_error("not a confluent archive");
+  internal::env<traits> env(provider.get());
+  internal::node_table_reader<traits, codec<typename Container::value_type>>
+      reader;
+  std::vector<Container> containers;
+  char record;
+  for (stream.read(&record, 1); record == 'N'; stream.read(&record, 1))
+    reader.read(env, stream);
+  if (record != 'R')
+    throw std::runtime_error("corrupt node table");
+  for (std::uint64_t n = internal::read_uint64(stream); n > 0; --n)
+    containers.push_back(internal::access::make<Container>(
+        provider, reader.node(internal::read_uint64(stream))));
+  return containers;
+}
+
+/**
+ * An append-only log of versions of a set or a map, in which each checkpoint
+ * writes only the nodes that are not already in the log.
+ *
+ * Nodes get stable ids from their positions in the log, and each checkpoint
+ * writes the new nodes of a version followed by the id of its root. Since new
+ * versions share most nodes with earlier versions, the size of a checkpoint is
+ * proportional to the changes since the earlier checkpoints rather than to the
+ * size of the version.
+ *
+ * checkpoint_log<set<int>> log;
+ * std::ofstream out("history.log", std::ios::binary | std::ios::app);
+ * log.checkpoint(out, version1);
+ * log.checkpoint(out, version2);
+ *
+ * After a restart, recover() replays the log into the provider and returns the
+ * recorded versions. The checkpoint_log then knows the ids of all nodes in the
+ * log, so that later checkpoints can be appended to it.
+ *
+ * The checkpoint_log keeps the nodes in the log alive, so that they are
+ * identified by address, which uses memory proportional to the number of
+ * nodes in the log.
+ *
+ * @tparam Container type of the recorded containers, a set or a map
+ * @tparam Codec encodes the values of the container, see codec
+ **/
+template <class Container,
+          class Codec = codec<typename Container::value_type>>
+class checkpoint_log {
+  typedef typename internal::access::traits<Container>::type traits;
+
+ public:
+  typedef Container container_type;
+  typedef typename Container::provider_type provider_type;
+  typedef typename Container::provider_ptr provider_ptr;
+
+  /**
+   * Constructs a new empty log.
+   *
+   * @param provider provider of the recorded and recovered containers
+   **/
+  explicit checkpoint_log(
+      provider_ptr provider = provider_type::default_provider())
+      : provider_(std::move(provider)),
+        versions_(0),
+        started_(false),
+        recovered_size_(0) {}
+
+  checkpoint_log(const checkpoint_log&) = delete;
+  checkpoint_log& operator=(const checkpoint_log&) = delete;
+
+  /**
+   * Destructor.
+   **/
+  ~checkpoint_log() { clear(); }
+
+  /**
+   * Appends a checkpoint of a version to the log.
+   *
+   * The stream is any object with the members:
+   *
+   * void write(const char* s, size_t n);  // writes n bytes
+   * void flush();                         // sends buffered bytes
+   *
+   * which includes std::ostream. The stream must be positioned at the end of
+   * the log, i.e. at recovered_size() after recovery. The stream is flushed
+   * when the checkpoint is written.
+   *
+   * Result is undefined if not the version is using the provider of the log.
+   *
+   * @param stream stream to append to
+   * @param version the version to record
+   * @return the number of nodes written by this checkpoint
+   *
+   * Let m be the number of nodes of the version that are not in the log.
+   *
+   * Complexity: O(m) expected time and written bytes.
+   **/
+  template <class Stream>
+  size_t checkpoint(Stream& stream, const Container& version) {
+    assert(version.provider() == provider_);
+    internal::env<traits> env(provider_.get());
+    if (!started_) {
+      stream.write(header, sizeof(header));
+      started_ = true;
+    }
+    size_t size = writer_.size();
+    std::uint64_t root = writer_.write(stream, internal::access::node(version));
+    const char record = 'R';
+    stream.write(&record, 1);
+    internal::write_uint64(stream, 1);
+    internal::write_uint64(stream, root);
+    stream.flush();
+    ++versions_;
+    return writer_.size() - size;
+  }
+
+  /**
+   * Replays a log into the provider and returns the recorded versions.
+   *
+   * The stream is a std::istream, or any object with the members:
+   *
+   * void read(char* s, size_t n);  // reads n bytes
+   * int peek();                    // returns EOF at the end of the stream
+   * explicit operator bool();      // returns false after a failed read
+   *
+   * A checkpoint that is cut off at the end of the log, e.g. by a crash while
+   * it was written, is ignored. The log must then be truncated to
+   * recovered_size() bytes before more checkpoints are appended.
+   *
+   * Must be called before any other checkpoint is recorded by this object.
+   *
+   * @param stream stream positioned at the start of the log
+   * @return the versions of the complete checkpoints, in the order they were
+   *   recorded
+   * @throw std::runtime_error if the log is not valid, leaving this object
+   *   unchanged
+   *
+   * Let m be the number of nodes in the log.
+   *
+   * Complexity: O(m) expected time.
+   **/
+  template <class Stream>
+  std::vector<Container> recover(Stream& stream) {
+    assert(!started_);
+    internal::env<traits> env(provider_.get());
+    internal::node_table_reader<traits, Codec> reader;
+    std::vector<Container> versions;
+    recovered_reader<Stream> in{stream, 0};
+    // The state of this object is only updated once the log has been read, so
+    // that a failed recovery leaves it writing a new log.
+    bool started = false;
+    std::uint64_t recovered_size = 0;
+    size_t nodes = 0;
+    try {
+      if (stream.peek() != std::char_traits<char>::eof()) {
+        char buffer[sizeof(header)];
+        in.read(buffer, sizeof(buffer));
+        if (!std::equal(header, header + sizeof(header), buffer))
+          throw std::runtime_error("not a confluent checkpoint log");
+        recovered_size = in.size_;
+        started = true;
+      }
+      while (started && stream.peek() != std::char_traits<char>::eof()) {
+        char record;
+        in.read(&record, 1);
+        if (record == 'N') {
+          reader.read(env, in);
+          continue;
+        }
+        if (record != 'R')
+          throw std::runtime_error("corrupt checkpoint log");
+        std::vector<Container> roots;
+        for (std::uint64_t n = internal::read_uint64(in); n > 0; --n)
+          roots.push_back(internal::access::make<Container>(
+              provider_, reader.node(internal::read_uint64(in))));
+        versions.insert(versions.end(), roots.begin(), roots.end());
+        nodes = reader.size();
+        recovered_size = in.size_;
+      }
+    } catch (const truncated&) {
+    }
+    reader.truncate(nodes);
+    for (size_t id = 1; id <= nodes; ++id)
+      writer_.add(reader.node(id));
+    versions_ = versions.size();
+    started_ = started;
+    recovered_size_ = recovered_size;
+    return versions;
+  }
+
+  /**
+   * Returns the number of nodes in the log.
+   **/
+  size_t size() const { return writer_.size(); }
+
+  /**
+   * Returns the number of versions in the log.
+   **/
+  size_t versions() const { return versions_; }
+
+  /**
+   * Returns the size in bytes of the complete checkpoints found by recover().
+   **/
+  std::uint64_t recovered_size() const { return recovered_size_; }
+
+  /**
+   * Forgets the nodes in the log, after which this object writes a new log.
+   **/
+  void clear() {
+    internal::env<traits> env(provider_.get());
+    writer_.clear();
+    versions_ = 0;
+    started_ = false;
+    recovered_size_ = 0;
+  }
+
+  /**
+   * Returns the provider of the log.
+   **/
+  const provider_ptr& provider() const { return provider_; }
+
+ private:
+  struct truncated {};
+
+  // Reads from the log, counting the read bytes and throwing truncated when
+  // the log ends.
+  template <class Stream>
+  struct recovered_reader {
+    void read(char* s, size_t n) {
+      stream_.read(s, n);
+      if (!stream_)
+        throw truncated();
+      size_ += n;
+    }
+
+    Stream& stream_;
+    std::uint64_t size_;
+  };
+
+  static constexpr char header[4] = {'C', 'F', 'L', '1'};
+
+  provider_ptr provider_;
+  internal::node_table_writer<traits, Codec> writer_;
+  size_t versions_;
+  bool started_;
+  std::uint64_t recovered_size_;
+};
+
+template <class Container, class Codec>
+constexpr char checkpoint_log<Container, Codec>::header[4];
+
+}  // namespace confluent
+
+#endif  // CONFLUENT_SERIALIZE_H_INCLUDED
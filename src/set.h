@@ -5,13 +5,22 @@
 #ifndef CONFLUENT_SET_H_INCLUDED
 #define CONFLUENT_SET_H_INCLUDED
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <functional>
 #include <initializer_list>
 #include <iterator>
+#include <limits>
 #include <memory>
 #include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -36,6 +45,27 @@ class map;
 
 namespace internal {
 
+// Defining CONFLUENT_COMPACT_NODES before including the headers selects a
+// compact node layout, which stores reference counts, subtree sizes and
+// priorities of set nodes in 32 bits. Priorities are then truncated to 32 bits,
+// with ties broken by comparing keys as before, and containers are limited to
+// 2^32 - 1 elements. A set<int> node shrinks from 64 to 48 bytes.
+#ifdef CONFLUENT_COMPACT_NODES
+typedef std::uint32_t node_count_type;
+#else
+typedef size_t node_count_type;
+#endif
+
+// Returns a subtree size in the node layout, throwing std::length_error if it
+// does not fit.
+inline node_count_type node_size(size_t n) {
+#ifdef CONFLUENT_COMPACT_NODES
+  if (n > std::numeric_limits<node_count_type>::max())
+    throw std::length_error("too many elements for compact nodes");
+#endif
+  return static_cast<node_count_type>(n);
+}
+
 // Thomas Wang's 32 bit mix function
 inline std::uint32_t intmix(std::uint32_t key) {
   key = ~key + (key << 15);  // key = (key << 15) - key - 1;
@@ -76,6 +106,18 @@ struct node;
 template <class Traits>
 struct node_ptr;
 
+template <class Traits>
+struct hash_table;
+
+template <class Traits>
+struct release_batch;
+
+template <class Traits>
+struct reclaimer;
+
+template <class Traits>
+struct operation_cache;
+
 template <class Traits>
 struct node_ptr {
   node_ptr() : node_(nullptr) {}
@@ -94,8 +136,8 @@ struct node_ptr {
   node_ptr(node_ptr&& other) : node_(other.node_) { other.node_ = nullptr; }
 
   ~node_ptr() {
-    if (node_ && !decref(node_))
-      delete node_;
+    if (node_)
+      release(node_);
   }
 
   node_ptr& operator=(const node_ptr& other) {
@@ -104,8 +146,8 @@ struct node_ptr {
   }
 
   node_ptr& operator=(node_ptr&& other) {
-    if (node_ && !decref(node_))
-      delete node_;
+    if (node_)
+      release(node_);
     node_ = other.node_;
     other.node_ = nullptr;
     return *this;
@@ -115,8 +157,8 @@ struct node_ptr {
     if (node_ != p) {
       if (add_ref && p)
         incref(p);
-      if (node_ && !decref(node_))
-        delete node_;
+      if (node_)
+        release(node_);
       node_ = p;
     }
   }
@@ -138,22 +180,30 @@ struct node_ptr {
     p->reference_count_.fetch_add(1, std::memory_order_relaxed);
   }
 
-  size_t decref(node<Traits>* p) const {
-    size_t count = p->reference_count_.load(std::memory_order_relaxed);
-    while (1) {
-      if (count == 1) {
-        std::lock_guard<std::mutex> lock(env<Traits>::get_hash_table().mutex_);
-        if (p->reference_count_.compare_exchange_strong(
-                count, 0, std::memory_order_relaxed)) {
-          env<Traits>::get_hash_table().erase(p);
-          return 0;
-        }
-      } else {
-        if (p->reference_count_.compare_exchange_weak(
-                count, count - 1, std::memory_order_relaxed))
-          return 1;
-      }
+  // Drops a reference unless it is the last one. Returns false, leaving the
+  // reference count unchanged, if it is the last one.
+  static bool decref(node<Traits>* p) {
+    node_count_type count =
+        p->reference_count_.load(std::memory_order_relaxed);
+    while (count != 1) {
+      if (p->reference_count_.compare_exchange_weak(count, count - 1,
+                                                    std::memory_order_release,
+                                                    std::memory_order_relaxed))
+        return true;
     }
+    return false;
+  }
+
+  // Drops a reference. Nodes losing their last references are handed over to
+  // the release batch of the thread.
+  static void release(node<Traits>* p) {
+    if (!decref(p))
+      release_batch<Traits>::release(p);
+  }
+
+  static void destroy(node<Traits>* p) {
+    p->~node();
+    env<Traits>::get_node_allocator().deallocate(p);
   }
 
   static const node_ptr null_;
@@ -161,9 +211,56 @@ struct node_ptr {
   node<Traits>* node_;
 };
 
+// Deleter for nodes that have not been shared.
+template <class Traits>
+struct node_deleter {
+  void operator()(node<Traits>* p) const { node_ptr<Traits>::destroy(p); }
+};
+
 template <class Traits>
 const node_ptr<Traits> node_ptr<Traits>::null_;
 
+// Counter that is only written while holding a lock, and that can be read
+// without locking.
+struct locked_counter {
+  locked_counter() : value_(0) {}
+
+  void add(size_t n = 1) {
+    value_.store(value_.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+  }
+
+  size_t get() const { return value_.load(std::memory_order_relaxed); }
+
+  std::atomic<size_t> value_;
+};
+
+// Invocations of the functors of a provider, counted by a single thread. The
+// counts are zero initialized as thread local variables without constructor.
+struct call_counts {
+  size_t comparisons_;
+  size_t equality_tests_;
+  size_t hashes_;
+};
+
+// Counts invocations of the functors of a provider. Threads count calls in
+// thread local counts that are added to the provider when they leave its
+// environment, so that counting a call does not write shared memory.
+struct call_counters {
+  call_counters() : comparisons_(0), equality_tests_(0), hashes_(0) {}
+
+  void add(const call_counts& counts) {
+    comparisons_.fetch_add(counts.comparisons_, std::memory_order_relaxed);
+    equality_tests_.fetch_add(counts.equality_tests_,
+                              std::memory_order_relaxed);
+    hashes_.fetch_add(counts.hashes_, std::memory_order_relaxed);
+  }
+
+  std::atomic<size_t> comparisons_;
+  std::atomic<size_t> equality_tests_;
+  std::atomic<size_t> hashes_;
+};
+
 template <class Traits>
 struct hash_table {
   hash_table()
@@ -177,13 +274,16 @@ struct hash_table {
     while (*p) {
       if ((*p)->hash_ == key->hash_ && (*p)->left_ == key->left_ &&
           (*p)->right_ == key->right_ &&
-          env<Traits>::equal((*p)->value(), key->value()))
+          env<Traits>::equal((*p)->value(), key->value())) {
+        reused_.add();
         return *p;
+      }
       p = &(*p)->next_;
     }
     *p = key;
     key->next_ = nullptr;
     ++size_;
+    created_.add();
     return key;
   }
 
@@ -193,13 +293,17 @@ struct hash_table {
       p = &(*p)->next_;
     *p = key->next_;
     --size_;
+    freed_.add();
   }
 
   void rehash() {
-    if (size_ >= bucket_count_)
+    if (size_ >= bucket_count_) {
       extend();
-    else if (size_ > min_bucket_count_ && (size_ << 1) < bucket_count_)
+      rehashes_.add();
+    } else if (size_ > min_bucket_count_ && (size_ << 1) < bucket_count_) {
       reduce();
+      rehashes_.add();
+    }
   }
 
   static std::unique_ptr<node<Traits>* []> alloc(size_t bucket_count) {
@@ -255,32 +359,607 @@ struct hash_table {
   std::unique_ptr<node<Traits>*[]> buckets_;
   size_t bucket_count_;
   size_t size_;
+
+  // Statistics, written while the mutex is locked.
+  locked_counter created_;
+  locked_counter reused_;
+  locked_counter freed_;
+  locked_counter rehashes_;
+  locked_counter contended_locks_;
+  locked_counter lock_wait_ns_;
+};
+
+// Locks a segment of a node table. Time spent waiting for other threads to
+// unlock the segment is added to the statistics of the segment.
+template <class Traits>
+struct segment_lock {
+  explicit segment_lock(hash_table<Traits>& table) : table_(table) {
+    if (!table.mutex_.try_lock()) {
+      auto start = std::chrono::steady_clock::now();
+      table.mutex_.lock();
+      table.contended_locks_.add();
+      table.lock_wait_ns_.add(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start)
+              .count());
+    }
+  }
+
+  segment_lock(const segment_lock&) = delete;
+
+  ~segment_lock() { table_.mutex_.unlock(); }
+
+  hash_table<Traits>& table_;
+};
+
+// The node table of a provider. Nodes are distributed over a power of two
+// number of independently locked hash tables, selected by remixed hash values
+// to keep the selection independent of the bucket positions within a segment.
+template <class Traits>
+struct node_table {
+  explicit node_table(size_t concurrency)
+      : segment_count_(round_up(concurrency)),
+        segments_(new std::unique_ptr<hash_table<Traits>>[segment_count_]),
+        size_(0),
+        peak_size_(0) {
+    for (size_t i = 0; i < segment_count_; ++i)
+      segments_[i].reset(new hash_table<Traits>());
+  }
+
+  hash_table<Traits>& segment(const node<Traits>* key) const {
+    return *segments_[index(key)];
+  }
+
+  size_t index(const node<Traits>* key) const {
+    if (segment_count_ == 1)
+      return 0;
+    return intmix(key->hash_) & (segment_count_ - 1);
+  }
+
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+  // Accounts for nodes inserted into the segments.
+  void add(size_t n) {
+    size_t size = size_.fetch_add(n, std::memory_order_relaxed) + n;
+    size_t peak = peak_size_.load(std::memory_order_relaxed);
+    while (size > peak &&
+           !peak_size_.compare_exchange_weak(peak, size,
+                                             std::memory_order_relaxed)) {
+    }
+  }
+
+  // Accounts for nodes erased from the segments.
+  void remove(size_t n) { size_.fetch_sub(n, std::memory_order_relaxed); }
+
+  template <class Member>
+  size_t sum(Member member) const {
+    size_t n = 0;
+    for (size_t i = 0; i < segment_count_; ++i)
+      n += ((*segments_[i]).*member).get();
+    return n;
+  }
+
+  static size_t round_up(size_t concurrency) {
+    size_t n = 1;
+    while (n < concurrency && n < max_segment_count_)
+      n <<= 1;
+    return n;
+  }
+
+  // Upper limit for the number of segments. Must be power of two.
+  static constexpr size_t max_segment_count_ = 1 << 10;
+
+  const size_t segment_count_;
+  const std::unique_ptr<std::unique_ptr<hash_table<Traits>>[]> segments_;
+  std::atomic<size_t> size_;
+  std::atomic<size_t> peak_size_;
+};
+
+// Nodes whose last references have been dropped by a thread. Instead of
+// locking a segment of the node table once per node, and freeing the children
+// of a node recursively from its destructor, nodes are collected and then
+// unlinked in chunks, locking each segment once per chunk. Destroying a node
+// drops the references to its children, which are added to the same batch, so
+// trees of any depth are freed iteratively.
+template <class Traits>
+struct release_batch {
+  typedef typename Traits::provider provider_type;
+
+  explicit release_batch(provider_type* provider)
+      : provider_(provider), saved_(active()) {
+    active() = this;
+  }
+
+  release_batch(const release_batch&) = delete;
+
+  ~release_batch() { active() = saved_; }
+
+  // Releases a node whose last reference is held by the caller. The node is
+  // added to the batch being drained by the thread, if there is one for the
+  // same provider. Otherwise it is queued by the reclaimer of the provider,
+  // if reclamation is deferred and the node has children, or else released
+  // by a new batch.
+  static void release(node<Traits>* p) {
+    provider_type* provider = env<Traits>::provider_;
+    release_batch* batch = active();
+    if (batch && batch->provider_ == provider) {
+      batch->nodes_.push_back(p);
+    } else if ((p->left_ || p->right_) &&
+               env<Traits>::get_reclaimer().deferred()) {
+      env<Traits>::get_reclaimer().defer(p);
+    } else {
+      release_batch new_batch(provider);
+      new_batch.drain(p);
+    }
+  }
+
+  // Destroys a node and then the nodes collected while destroying it.
+  void drain(node<Traits>* p) {
+    node_table<Traits>& tables = env<Traits>::get_node_table();
+    {
+      segment_lock<Traits> lock(tables.segment(p));
+      if (!unlink(lock.table_, p))
+        return;
+    }
+    tables.remove(1);
+    node_ptr<Traits>::destroy(p);
+    while (!nodes_.empty())
+      step();
+  }
+
+  // Unlinks and destroys a chunk of the collected nodes, locking each segment
+  // once. Returns the number of destroyed nodes.
+  size_t step() {
+    node_table<Traits>& tables = env<Traits>::get_node_table();
+    size_t n =
+        nodes_.size() < max_chunk_size_ ? nodes_.size() : max_chunk_size_;
+    ends_.resize(tables.segment_count_);
+    group(tables, nodes_.end() - n, nodes_.end(), &chunk_, &ends_);
+    nodes_.resize(nodes_.size() - n);
+    size_t begin = 0;
+    size_t out = 0;
+    for (size_t i = 0; begin < n; ++i) {
+      if (begin == ends_[i])
+        continue;
+      segment_lock<Traits> lock(*tables.segments_[i]);
+      for (; begin < ends_[i]; ++begin) {
+        if (unlink(lock.table_, chunk_[begin]))
+          chunk_[out++] = chunk_[begin];
+      }
+    }
+    tables.remove(out);
+    for (size_t i = 0; i < out; ++i)
+      node_ptr<Traits>::destroy(chunk_[i]);
+    return out;
+  }
+
+  // Orders the nodes of a range by segment with a counting sort, and sets the
+  // end positions of the segments in the ordered chunk.
+  template <class Iterator>
+  static void group(const node_table<Traits>& tables,
+                    Iterator first,
+                    Iterator last,
+                    std::vector<node<Traits>*>* chunk,
+                    std::vector<size_t>* ends) {
+    std::fill(ends->begin(), ends->end(), 0);
+    for (Iterator it = first; it != last; ++it)
+      ++(*ends)[tables.index(*it)];
+    size_t end = 0;
+    for (size_t& count : *ends) {
+      end += count;
+      count = end - count;
+    }
+    chunk->resize(end);
+    for (Iterator it = first; it != last; ++it)
+      (*chunk)[(*ends)[tables.index(*it)]++] = *it;
+  }
+
+  // Drops the reference to a node that was handed over to the batch, and
+  // unlinks the node if the reference is still the last one. Otherwise the
+  // node has been shared again, by a lookup in the node table, after the
+  // reference was handed over. Requires the segment to be locked.
+  static bool unlink(hash_table<Traits>& table, node<Traits>* p) {
+    node_count_type count = 1;
+    while (!p->reference_count_.compare_exchange_weak(
+        count, count == 1 ? 0 : count - 1, std::memory_order_acq_rel,
+        std::memory_order_relaxed)) {
+    }
+    if (count != 1)
+      return false;
+    table.erase(p);
+    return true;
+  }
+
+  static release_batch*& active() {
+    static thread_local release_batch* batch = nullptr;
+    return batch;
+  }
+
+  // Upper limit for the number of nodes unlinked per round.
+  static constexpr size_t max_chunk_size_ = 1 << 8;
+
+  provider_type* const provider_;
+  release_batch* const saved_;
+  std::vector<node<Traits>*> nodes_;
+  std::vector<node<Traits>*> chunk_;
+  std::vector<size_t> ends_;
+};
+
+// Memory for the nodes of a provider. Nodes are carved from slabs of growing
+// size and recycled through a free list. The slabs are released together when
+// the pool is destroyed.
+template <class Traits>
+struct node_pool {
+  union block {
+    block* next_;
+    typename std::aligned_storage<sizeof(node<Traits>),
+                                  alignof(node<Traits>)>::type storage_;
+  };
+
+  node_pool()
+      : id_(next_id()),
+        free_(nullptr),
+        carve_(nullptr),
+        carve_end_(nullptr),
+        slab_capacity_(min_slab_capacity_) {}
+
+  node_pool(const node_pool&) = delete;
+
+  ~node_pool() {
+    for (void* slab : slabs_)
+      ::operator delete(slab);
+  }
+
+  // Returns a list of n free blocks.
+  block* acquire(size_t n) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    block* head = nullptr;
+    for (size_t i = 0; i < n; ++i) {
+      block* b = free_;
+      if (b) {
+        free_ = b->next_;
+      } else {
+        if (carve_ == carve_end_)
+          grow();
+        b = carve_++;
+      }
+      b->next_ = head;
+      head = b;
+    }
+    return head;
+  }
+
+  // Returns a list of free blocks from head to tail to the pool.
+  void release(block* head, block* tail) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tail->next_ = free_;
+    free_ = head;
+  }
+
+  void grow() {
+    void* slab =
+        ::operator new(slab_capacity_ * sizeof(block) + alignof(block) - 1);
+    slabs_.push_back(slab);
+    size_t offset = reinterpret_cast<std::uintptr_t>(slab) % alignof(block);
+    carve_ = reinterpret_cast<block*>(static_cast<char*>(slab) +
+                                      (offset ? alignof(block) - offset : 0));
+    carve_end_ = carve_ + slab_capacity_;
+    if (slab_capacity_ < max_slab_capacity_)
+      slab_capacity_ *= 2;
+  }
+
+  static std::uint64_t next_id() {
+    static std::atomic<std::uint64_t> id(0);
+    return ++id;
+  }
+
+  // Number of blocks in the first slab and upper limit for later slabs.
+  static constexpr size_t min_slab_capacity_ = 1 << 5;
+  static constexpr size_t max_slab_capacity_ = 1 << 12;
+
+  const std::uint64_t id_;
+  std::mutex mutex_;
+  block* free_;
+  block* carve_;
+  block* carve_end_;
+  size_t slab_capacity_;
+  std::vector<void*> slabs_;
+};
+
+// Per thread cache of free blocks from the pool that the thread most recently
+// allocated nodes from or released nodes to. Blocks are moved between the
+// cache and the pool in batches to avoid locking the pool for every node.
+template <class Traits>
+struct node_cache {
+  typedef typename node_pool<Traits>::block block;
+
+  node_cache() : id_(0), head_(nullptr), count_(0) {}
+
+  ~node_cache() {
+    flush();
+    destroyed_ = true;
+  }
+
+  void select(const std::shared_ptr<node_pool<Traits>>& pool) {
+    if (id_ != pool->id_) {
+      flush();
+      pool_ = pool;
+      id_ = pool->id_;
+    }
+  }
+
+  void* allocate(const std::shared_ptr<node_pool<Traits>>& pool) {
+    select(pool);
+    if (!head_) {
+      head_ = pool->acquire(batch_size_);
+      count_ = batch_size_;
+    }
+    block* b = head_;
+    head_ = b->next_;
+    --count_;
+    return b;
+  }
+
+  void deallocate(const std::shared_ptr<node_pool<Traits>>& pool, void* p) {
+    select(pool);
+    block* b = static_cast<block*>(p);
+    b->next_ = head_;
+    head_ = b;
+    if (++count_ == 2 * batch_size_) {
+      block* tail = head_;
+      for (size_t i = 1; i < batch_size_; ++i)
+        tail = tail->next_;
+      block* rest = tail->next_;
+      pool->release(head_, tail);
+      head_ = rest;
+      count_ -= batch_size_;
+    }
+  }
+
+  // Returns cached blocks to their pool, unless the pool has been destroyed
+  // and already released the memory.
+  void flush() {
+    if (head_) {
+      if (std::shared_ptr<node_pool<Traits>> pool = pool_.lock()) {
+        block* tail = head_;
+        while (tail->next_)
+          tail = tail->next_;
+        pool->release(head_, tail);
+      }
+    }
+    head_ = nullptr;
+    count_ = 0;
+  }
+
+  // Number of blocks moved between the cache and the pool at a time.
+  static constexpr size_t batch_size_ = 1 << 5;
+
+  std::weak_ptr<node_pool<Traits>> pool_;
+  std::uint64_t id_;
+  block* head_;
+  size_t count_;
+
+  static thread_local node_cache instance_;
+
+  // Set when instance_ has been destroyed at the exit of the thread, after
+  // which nodes of containers with static storage duration are still freed.
+  static thread_local bool destroyed_;
+};
+
+template <class Traits>
+thread_local node_cache<Traits> node_cache<Traits>::instance_;
+
+template <class Traits>
+thread_local bool node_cache<Traits>::destroyed_ = false;
+
+// Allocator for the nodes of a provider.
+template <class Traits>
+struct node_allocator {
+  typedef typename node_pool<Traits>::block block;
+
+  node_allocator() : pool_(std::make_shared<node_pool<Traits>>()) {}
+
+  void* allocate() {
+    if (node_cache<Traits>::destroyed_)
+      return pool_->acquire(1);
+    return node_cache<Traits>::instance_.allocate(pool_);
+  }
+
+  void deallocate(void* p) {
+    if (node_cache<Traits>::destroyed_) {
+      block* b = static_cast<block*>(p);
+      pool_->release(b, b);
+      return;
+    }
+    node_cache<Traits>::instance_.deallocate(pool_, p);
+  }
+
+  const std::shared_ptr<node_pool<Traits>> pool_;
 };
 
 template <class Traits>
 struct env_base {
   env_base(typename Traits::provider* provider) : saved_provider_(provider_) {
+    if (provider != saved_provider_)
+      flush_call_counts();
     provider_ = provider;
   }
 
   env_base(const env_base&) = delete;
 
-  ~env_base() { provider_ = saved_provider_; }
+  ~env_base() {
+    if (provider_ != saved_provider_)
+      flush_call_counts();
+    provider_ = saved_provider_;
+  }
 
   void silence_unused_warning() const {}
 
-  static hash_table<Traits>& get_hash_table() { return provider_->hash_table_; }
+  static node_table<Traits>& get_node_table() { return provider_->node_table_; }
+
+  static node_allocator<Traits>& get_node_allocator() {
+    return provider_->node_allocator_;
+  }
+
+  static reclaimer<Traits>& get_reclaimer() { return provider_->reclaimer_; }
+
+  static call_counts& get_call_counts() { return call_counts_; }
+
+  // Adds the calls counted by this thread to the provider of the environment.
+  static void flush_call_counts() {
+    if (!provider_)
+      return;
+    provider_->call_counters_.add(call_counts_);
+    call_counts_ = call_counts();
+  }
+
+  static operation_cache<Traits>& get_operation_cache() {
+    return provider_->operation_cache_;
+  }
 
   typename Traits::provider* const saved_provider_;
 
   static thread_local typename Traits::provider* provider_;
+  static thread_local call_counts call_counts_;
 };
 
 template <class Traits>
 thread_local typename Traits::provider* env_base<Traits>::provider_;
 
+template <class Traits>
+thread_local call_counts env_base<Traits>::call_counts_;
+
 enum class ranking { LEFT = -1, SAME = 0, RIGHT = 1, NOT_SAME };
 
+enum class set_operation {
+  set_union,
+  set_intersection,
+  set_difference,
+  set_symmetric
+};
+
+// Bounded and lossy cache of results of set operations, like the computed
+// table of BDD packages. Since nodes are hash-consed, the result of a set
+// operation is determined by the operation and the root nodes of its inputs.
+// Entries hold references to their input and result nodes, so that cached
+// nodes are not freed and reused for other trees. Threads that find a segment
+// of the cache locked by another thread skip the cache instead of waiting.
+template <class Traits>
+struct operation_cache {
+  typedef ranking (*ranker_type)(const env<Traits>&,
+                                 const node<Traits>&,
+                                 const node<Traits>&);
+
+  struct entry {
+    entry() : operation_(), ranker_(nullptr) {}
+
+    set_operation operation_;
+    ranker_type ranker_;
+    node_ptr<Traits> left_;
+    node_ptr<Traits> right_;
+    node_ptr<Traits> result_;
+  };
+
+  struct segment {
+    explicit segment(size_t size) : entries_(new entry[size]) {}
+
+    std::mutex mutex_;
+    const std::unique_ptr<entry[]> entries_;
+    locked_counter hits_;
+    locked_counter misses_;
+  };
+
+  operation_cache(size_t size, size_t concurrency)
+      : segment_count_(size ? node_table<Traits>::round_up(concurrency) : 0),
+        segment_size_(size ? round_up(size / segment_count_) : 0),
+        segments_(new std::unique_ptr<segment>[segment_count_]) {
+    for (size_t i = 0; i < segment_count_; ++i)
+      segments_[i].reset(new segment(segment_size_));
+  }
+
+  bool enabled() const { return segment_count_ != 0; }
+
+  // Looks up the result of an operation. Returns false if the result is not
+  // cached or if the segment is locked by another thread.
+  bool find(set_operation operation,
+            ranker_type ranker,
+            const node<Traits>* left,
+            const node<Traits>* right,
+            node_ptr<Traits>* result) {
+    size_t h = hash_combine(left->hash_, right->hash_, size_t(operation));
+    segment& s = *segments_[index(h)];
+    if (!s.mutex_.try_lock())
+      return false;
+    std::lock_guard<std::mutex> lock(s.mutex_, std::adopt_lock);
+    entry& e = s.entries_[slot(h)];
+    if (e.operation_ == operation && e.ranker_ == ranker &&
+        e.left_.get() == left && e.right_.get() == right) {
+      *result = e.result_;
+      s.hits_.add();
+      return true;
+    }
+    s.misses_.add();
+    return false;
+  }
+
+  // Caches the result of an operation, replacing any entry in the same slot.
+  void insert(set_operation operation,
+              ranker_type ranker,
+              node_ptr<Traits> left,
+              node_ptr<Traits> right,
+              node_ptr<Traits> result) {
+    size_t h = hash_combine(left->hash_, right->hash_, size_t(operation));
+    segment& s = *segments_[index(h)];
+    if (!s.mutex_.try_lock())
+      return;
+    // The replaced nodes are released by the arguments after unlocking.
+    std::lock_guard<std::mutex> lock(s.mutex_, std::adopt_lock);
+    entry& e = s.entries_[slot(h)];
+    e.operation_ = operation;
+    e.ranker_ = ranker;
+    e.left_.swap(left);
+    e.right_.swap(right);
+    e.result_.swap(result);
+  }
+
+  void clear() {
+    for (size_t i = 0; i < segment_count_; ++i) {
+      for (size_t j = 0; j < segment_size_; ++j) {
+        entry e;
+        {
+          std::lock_guard<std::mutex> lock(segments_[i]->mutex_);
+          std::swap(e, segments_[i]->entries_[j]);
+        }
+      }
+    }
+  }
+
+  template <class Member>
+  size_t sum(Member member) const {
+    size_t n = 0;
+    for (size_t i = 0; i < segment_count_; ++i)
+      n += ((*segments_[i]).*member).get();
+    return n;
+  }
+
+  size_t index(size_t h) const { return intmix(h) & (segment_count_ - 1); }
+
+  size_t slot(size_t h) const {
+    return (intmix(h) / segment_count_) & (segment_size_ - 1);
+  }
+
+  static size_t round_up(size_t size) {
+    size_t n = 1;
+    while (n < size)
+      n <<= 1;
+    return n;
+  }
+
+  const size_t segment_count_;
+  const size_t segment_size_;
+  const std::unique_ptr<std::unique_ptr<segment>[]> segments_;
+};
+
 template <class Traits>
 size_t hash(const node<Traits>* p) {
   return p ? p->hash_ : 0;
@@ -343,13 +1022,38 @@ void reset(const env<Traits>& env, node_ptr<Traits>* p) {
   p->reset();
 }
 
+// Allocates memory for a node that is constructed by the given function.
+template <class Traits, class Construct>
+std::unique_ptr<node<Traits>, node_deleter<Traits>> allocate_node(
+    Construct construct) {
+  env<Traits>::get_reclaimer().advance();
+  node_allocator<Traits>& allocator = env<Traits>::get_node_allocator();
+  void* p = allocator.allocate();
+  try {
+    return std::unique_ptr<node<Traits>, node_deleter<Traits>>(construct(p));
+  } catch (...) {
+    allocator.deallocate(p);
+    throw;
+  }
+}
+
 template <class Traits>
-node_ptr<Traits> get_unique_node(const env<Traits>& env,
-                                 std::unique_ptr<node<Traits>> p) {
-  std::lock_guard<std::mutex> lock(env.get_hash_table().mutex_);
-  node<Traits>* q = env.get_hash_table().insert(p.get());
-  return q == p.get() ? node_ptr<Traits>(p.release(), false)
-                      : node_ptr<Traits>(q);
+node_ptr<Traits> get_unique_node(
+    const env<Traits>& env,
+    std::unique_ptr<node<Traits>, node_deleter<Traits>> p) {
+  node_table<Traits>& tables = env.get_node_table();
+  segment_lock<Traits> lock(tables.segment(p.get()));
+  node<Traits>* q = lock.table_.insert(p.get());
+  if (q != p.get())
+    return node_ptr<Traits>(q);
+  tables.add(1);
+  return node_ptr<Traits>(p.release(), false);
+}
+
+template <class Traits>
+size_t priority(const env<Traits, set_tag>& env,
+                const typename Traits::value_type& value) {
+  return static_cast<node_count_type>(intmix(env.hash(value)));
 }
 
 template <class Traits>
@@ -358,7 +1062,7 @@ node_ptr<Traits> make_node(const env<Traits, set_tag>& env,
                            node_ptr<Traits> left = nullptr,
                            node_ptr<Traits> right = nullptr) {
   return node<Traits>::create(env, value, std::move(left), std::move(right),
-                              intmix(env.hash(value)));
+                              priority(env, value));
 }
 
 template <class Traits>
@@ -442,28 +1146,81 @@ std::pair<node_ptr<Traits>, node_ptr<Traits>> split(
   }
 }
 
+// Consults the operation cache on behalf of a set operation on two non-empty
+// trees. Operations on small trees are not cached.
+template <class Traits>
+struct operation_memo {
+  typedef typename operation_cache<Traits>::ranker_type ranker_type;
+
+  operation_memo(const env<Traits>& env,
+                 set_operation operation,
+                 ranker_type ranker,
+                 const node_ptr<Traits>& left,
+                 const node_ptr<Traits>& right)
+      : cache_(nullptr), operation_(operation), ranker_(ranker), found_(false) {
+    operation_cache<Traits>& cache = env.get_operation_cache();
+    if (!cache.enabled() || size(left) + size(right) < min_size_)
+      return;
+    cache_ = &cache;
+    found_ = cache.find(operation, ranker, left.get(), right.get(), &result_);
+    if (!found_) {
+      left_ = left;
+      right_ = right;
+    }
+  }
+
+  bool found() const { return found_; }
+
+  node_ptr<Traits> result() { return std::move(result_); }
+
+  // Caches and returns a computed result.
+  node_ptr<Traits> operator()(node_ptr<Traits> result) {
+    if (cache_) {
+      cache_->insert(operation_, ranker_, std::move(left_), std::move(right_),
+                     result);
+    }
+    return result;
+  }
+
+  // Lower limit for the total size of cached inputs.
+  static constexpr size_t min_size_ = 1 << 5;
+
+  operation_cache<Traits>* cache_;
+  const set_operation operation_;
+  const ranker_type ranker_;
+  bool found_;
+  node_ptr<Traits> left_;
+  node_ptr<Traits> right_;
+  node_ptr<Traits> result_;
+};
+
 template <class Traits, class Left, class Right>
 node_ptr<Traits> set_union(const env<Traits>& env, Left&& left, Right&& right) {
   if (left == right || !right)
     return std::forward<Left>(left);
   if (!left)
     return std::forward<Right>(right);
+  operation_memo<Traits> memo(env, set_operation::set_union, nullptr, left,
+                              right);
+  if (memo.found())
+    return memo.result();
   switch (rank(env, *left, *right)) {
     case ranking::LEFT: {
       auto s = split(env, std::forward<Right>(right), left->key());
-      return make_node(env, *left,
-                       set_union(env, left->left_, std::move(s.first)),
-                       set_union(env, left->right_, std::move(s.second)));
+      return memo(make_node(env, *left,
+                            set_union(env, left->left_, std::move(s.first)),
+                            set_union(env, left->right_, std::move(s.second))));
     }
     case ranking::RIGHT: {
       auto s = split(env, std::forward<Left>(left), right->key());
-      return make_node(env, *right,
-                       set_union(env, std::move(s.first), right->left_),
-                       set_union(env, std::move(s.second), right->right_));
+      return memo(make_node(
+          env, *right, set_union(env, std::move(s.first), right->left_),
+          set_union(env, std::move(s.second), right->right_)));
     }
     default: {
-      return make_node(env, *left, set_union(env, left->left_, right->left_),
-                       set_union(env, left->right_, right->right_));
+      return memo(make_node(env, *left,
+                            set_union(env, left->left_, right->left_),
+                            set_union(env, left->right_, right->right_)));
     }
   }
 }
@@ -477,27 +1234,32 @@ node_ptr<Traits> set_intersection(const env<Traits>& env,
     return nullptr;
   if (left == right)
     return std::forward<Left>(left);
+  operation_memo<Traits> memo(env, set_operation::set_intersection, ranker,
+                              left, right);
+  if (memo.found())
+    return memo.result();
   switch (ranker(env, *left, *right)) {
     case ranking::LEFT: {
       auto s = split(env, std::forward<Right>(right), left->key());
-      return join(
+      return memo(join(
           env, set_intersection(env, ranker, left->left_, std::move(s.first)),
-          set_intersection(env, ranker, left->right_, std::move(s.second)));
+          set_intersection(env, ranker, left->right_, std::move(s.second))));
     }
     case ranking::RIGHT: {
       auto s = split(env, std::forward<Left>(left), right->key());
-      return join(
+      return memo(join(
           env, set_intersection(env, ranker, std::move(s.first), right->left_),
-          set_intersection(env, ranker, std::move(s.second), right->right_));
+          set_intersection(env, ranker, std::move(s.second), right->right_)));
     }
     case ranking::NOT_SAME: {
-      return join(env, set_intersection(env, ranker, left->left_, right->left_),
-                  set_intersection(env, ranker, left->right_, right->right_));
+      return memo(
+          join(env, set_intersection(env, ranker, left->left_, right->left_),
+               set_intersection(env, ranker, left->right_, right->right_)));
     }
     default: {
-      return make_node(
+      return memo(make_node(
           env, *left, set_intersection(env, ranker, left->left_, right->left_),
-          set_intersection(env, ranker, left->right_, right->right_));
+          set_intersection(env, ranker, left->right_, right->right_)));
     }
   }
 }
@@ -511,28 +1273,33 @@ node_ptr<Traits> set_difference(const env<Traits>& env,
     return nullptr;
   if (!right)
     return std::forward<Left>(left);
+  operation_memo<Traits> memo(env, set_operation::set_difference, ranker,
+                              left, right);
+  if (memo.found())
+    return memo.result();
   switch (ranker(env, *left, *right)) {
     case ranking::LEFT: {
       auto s = split(env, std::forward<Right>(right), left->key());
-      return make_node(
+      return memo(make_node(
           env, *left,
           set_difference(env, ranker, left->left_, std::move(s.first)),
-          set_difference(env, ranker, left->right_, std::move(s.second)));
+          set_difference(env, ranker, left->right_, std::move(s.second))));
     }
     case ranking::RIGHT: {
       auto s = split(env, std::forward<Left>(left), right->key());
-      return join(
+      return memo(join(
           env, set_difference(env, ranker, std::move(s.first), right->left_),
-          set_difference(env, ranker, std::move(s.second), right->right_));
+          set_difference(env, ranker, std::move(s.second), right->right_)));
     }
     case ranking::NOT_SAME: {
-      return make_node(
+      return memo(make_node(
           env, *left, set_difference(env, ranker, left->left_, right->left_),
-          set_difference(env, ranker, left->right_, right->right_));
+          set_difference(env, ranker, left->right_, right->right_)));
     }
     default: {
-      return join(env, set_difference(env, ranker, left->left_, right->left_),
-                  set_difference(env, ranker, left->right_, right->right_));
+      return memo(
+          join(env, set_difference(env, ranker, left->left_, right->left_),
+               set_difference(env, ranker, left->right_, right->right_)));
     }
   }
 }
@@ -547,66 +1314,646 @@ node_ptr<Traits> set_symmetric(const env<Traits>& env,
     return std::forward<Left>(left);
   if (left == right)
     return nullptr;
+  operation_memo<Traits> memo(env, set_operation::set_symmetric, nullptr, left,
+                              right);
+  if (memo.found())
+    return memo.result();
   switch (rank(env, *left, *right)) {
     case ranking::LEFT: {
       auto s = split(env, std::forward<Right>(right), left->key());
-      return make_node(env, *left,
-                       set_symmetric(env, left->left_, std::move(s.first)),
-                       set_symmetric(env, left->right_, std::move(s.second)));
+      return memo(
+          make_node(env, *left,
+                    set_symmetric(env, left->left_, std::move(s.first)),
+                    set_symmetric(env, left->right_, std::move(s.second))));
     }
     case ranking::RIGHT: {
       auto s = split(env, std::forward<Left>(left), right->key());
-      return make_node(env, *right,
-                       set_symmetric(env, std::move(s.first), right->left_),
-                       set_symmetric(env, std::move(s.second), right->right_));
+      return memo(
+          make_node(env, *right,
+                    set_symmetric(env, std::move(s.first), right->left_),
+                    set_symmetric(env, std::move(s.second), right->right_)));
     }
     default: {
-      return join(env, set_symmetric(env, left->left_, right->left_),
-                  set_symmetric(env, left->right_, right->right_));
+      return memo(join(env, set_symmetric(env, left->left_, right->left_),
+                       set_symmetric(env, left->right_, right->right_)));
     }
   }
 }
 
-template <class Traits, class Rank, class Left, class Right>
-bool includes(const env<Traits>& env, Rank ranker, Left&& left, Right&& right) {
-  if (left == right || !right)
-    return true;
+// Step of an expression over containers, stored in postfix order. A step either
+// pushes the operand with the given index or applies an operation to the two
+// topmost values.
+struct expression_step {
+  bool operand_;
+  size_t index_;
+  set_operation operation_;
+};
 
-  if (size(left) < size(right))
-    return false;
+template <class Traits>
+typename operation_cache<Traits>::ranker_type element_ranker(
+    const env<Traits, set_tag>& env) {
+  env.silence_unused_warning();
+  return &rank<Traits>;
+}
 
-  switch (ranker(env, *left, *right)) {
-    case ranking::LEFT: {
-      auto s = split(env, std::forward<Right>(right), left->key());
-      return includes(env, ranker, left->left_, std::move(s.first)) &&
-             includes(env, ranker, left->right_, std::move(s.second));
-    }
-    case ranking::SAME: {
-      return includes(env, ranker, left->left_, right->left_) &&
-             includes(env, ranker, left->right_, right->right_);
-    }
-    default: {
-      return false;
-    }
-  }
+// Subtree of an operand of an operation on several trees, covering the key
+// range of the current step. The keys of the subtree are bounded by the keys
+// of the ancestors where the path to it turns, which are null if the subtree
+// is not bounded on that side. Whole subtrees contain only keys that are
+// within the range.
+template <class Traits>
+struct subtree_cursor {
+  const node_ptr<Traits>* node_;
+  bool whole_;
+  const typename Traits::key_type* lo_;
+  const typename Traits::key_type* hi_;
+};
+
+// Cursor to the whole tree of a root.
+template <class Traits>
+subtree_cursor<Traits> root_cursor(const node_ptr<Traits>& root) {
+  return {&root, true, nullptr, nullptr};
 }
 
-template <class Traits, class InputIterator>
-node_ptr<Traits> make_node(const env<Traits>& env,
-                           InputIterator* first,
-                           InputIterator last,
-                           size_t max_depth) {
-  if (*first == last)
-    return nullptr;
-  node_ptr<Traits> root = make_node(env, **first);
-  ++*first;
-  for (size_t depth = 0; depth < max_depth; ++depth) {
-    node_ptr<Traits> branch = make_node(env, first, last, depth);
-    if (!branch)
-      break;
-    root = set_union(env, std::move(root), std::move(branch));
-  }
-  return root;
+// Cursor to the left or the right subtree of the root of a cursor. The child
+// is whole if its parent was whole and the range is split at the key of the
+// parent.
+template <class Traits>
+subtree_cursor<Traits> child_cursor(const subtree_cursor<Traits>& c,
+                                    bool left) {
+  const node<Traits>& p = **c.node_;
+  if (left)
+    return {&p.left_, c.whole_, c.lo_, &p.key()};
+  return {&p.right_, c.whole_, &p.key(), c.hi_};
+}
+
+// Moves a cursor to the largest subtree that can hold keys within a range.
+// Bounds are exclusive, and null if the range is unbounded.
+template <class Traits>
+void seek(const env<Traits>& env,
+          subtree_cursor<Traits>* c,
+          const typename Traits::key_type* lo,
+          const typename Traits::key_type* hi) {
+  while (*c->node_) {
+    const typename Traits::key_type& key = (*c->node_)->key();
+    if (lo && !env.compare(*lo, key)) {
+      c->node_ = &(*c->node_)->right_;
+      c->lo_ = &key;
+    } else if (hi && !env.compare(key, *hi)) {
+      c->node_ = &(*c->node_)->left_;
+      c->hi_ = &key;
+    } else {
+      return;
+    }
+    c->whole_ = false;
+  }
+}
+
+// Tests if a cursor covers a whole subtree, and remembers the result. The
+// bounds of a cursor are never inside the range of the current step, since
+// they are keys of ancestors that either split the range or were passed by
+// seek. The subtree is therefore whole if its bounds are equal to the bounds of
+// the range, which takes no more than two comparisons.
+template <class Traits>
+bool whole(const env<Traits>& env,
+           subtree_cursor<Traits>* c,
+           const typename Traits::key_type* lo,
+           const typename Traits::key_type* hi) {
+  if (!c->whole_) {
+    c->whole_ =
+        (!lo || c->lo_ == lo || (c->lo_ && !env.compare(*c->lo_, *lo))) &&
+        (!hi || c->hi_ == hi || (c->hi_ && !env.compare(*hi, *c->hi_)));
+  }
+  return c->whole_;
+}
+
+// Evaluates an expression over the trees of its operands in one recursive
+// pass. Operands are not split. Instead every operand is represented by a
+// cursor to the subtree that covers the key range of the current step, and
+// only the nodes of the result are created.
+template <class Traits>
+struct fused_evaluation {
+  typedef typename Traits::key_type key_type;
+  typedef typename operation_cache<Traits>::ranker_type ranker_type;
+
+  typedef subtree_cursor<Traits> cursor;
+
+  // Result of an expression when it can be determined without visiting the
+  // elements of the operands.
+  struct shape {
+    enum { EMPTY, TREE, UNKNOWN } kind_;
+    const node_ptr<Traits>* node_;
+  };
+
+  fused_evaluation(const env<Traits>& env,
+                   ranker_type ranker,
+                   const std::vector<expression_step>& steps,
+                   size_t operand_count)
+      : env_(env),
+        ranker_(ranker),
+        steps_(steps),
+        operand_count_(operand_count) {}
+
+  node_ptr<Traits> operator()(const std::vector<node_ptr<Traits>>& operands) {
+    cursors_.clear();
+    for (const node_ptr<Traits>& p : operands)
+      cursors_.push_back(root_cursor(p));
+    return eval(0, nullptr, nullptr);
+  }
+
+  node_ptr<Traits> eval(size_t offset, const key_type* lo, const key_type* hi) {
+    for (size_t i = 0; i < operand_count_; ++i)
+      seek(env_, &cursors_[offset + i], lo, hi);
+
+    shape s = eval_shape(offset, lo, hi);
+    if (s.kind_ == shape::EMPTY)
+      return nullptr;
+    if (s.kind_ == shape::TREE)
+      return *s.node_;
+
+    const node<Traits>* top = nullptr;
+    for (size_t i = 0; i < operand_count_; ++i) {
+      const node<Traits>* p = cursors_[offset + i].node_->get();
+      if (p && (!top || rank(env_, *p, *top) == ranking::LEFT))
+        top = p;
+    }
+    const node_ptr<Traits>* element = eval_element(offset, *top);
+
+    size_t child = offset + operand_count_;
+    if (cursors_.size() < child + operand_count_)
+      cursors_.resize(child + operand_count_);
+    descend(offset, *top, true);
+    node_ptr<Traits> left = eval(child, lo, &top->key());
+    descend(offset, *top, false);
+    node_ptr<Traits> right = eval(child, &top->key(), hi);
+
+    if (!element)
+      return join(env_, std::move(left), std::move(right));
+    if ((*element)->left_ == left && (*element)->right_ == right)
+      return *element;
+    return make_node(env_, **element, std::move(left), std::move(right));
+  }
+
+  shape eval_shape(size_t offset, const key_type* lo, const key_type* hi) {
+    shapes_.clear();
+    for (const expression_step& step : steps_) {
+      if (step.operand_) {
+        cursor& c = cursors_[offset + step.index_];
+        if (!*c.node_) {
+          shapes_.push_back({shape::EMPTY, nullptr});
+        } else {
+          shapes_.push_back({whole(env_, &c, lo, hi) ? shape::TREE
+                                                     : shape::UNKNOWN,
+                             c.node_});
+        }
+        continue;
+      }
+      shape r = shapes_.back();
+      shapes_.pop_back();
+      shape& l = shapes_.back();
+      bool same = l.kind_ == shape::TREE && r.kind_ == shape::TREE &&
+                  *l.node_ == *r.node_;
+      switch (step.operation_) {
+        case set_operation::set_union:
+          if (l.kind_ == shape::EMPTY || same)
+            l = r;
+          else if (r.kind_ != shape::EMPTY)
+            l.kind_ = shape::UNKNOWN;
+          break;
+        case set_operation::set_intersection:
+          if (r.kind_ == shape::EMPTY)
+            l = r;
+          else if (l.kind_ != shape::EMPTY && !same)
+            l.kind_ = shape::UNKNOWN;
+          break;
+        case set_operation::set_difference:
+          if (same)
+            l.kind_ = shape::EMPTY;
+          else if (l.kind_ != shape::EMPTY && r.kind_ != shape::EMPTY)
+            l.kind_ = shape::UNKNOWN;
+          break;
+        case set_operation::set_symmetric:
+          if (same)
+            l.kind_ = shape::EMPTY;
+          else if (l.kind_ == shape::EMPTY)
+            l = r;
+          else if (r.kind_ != shape::EMPTY)
+            l.kind_ = shape::UNKNOWN;
+          break;
+      }
+    }
+    return shapes_.back();
+  }
+
+  // Evaluates the expression for the element with the key of a given node,
+  // which is the root of every operand that contains the key. Returns the
+  // subtree that has the resulting element as root, or null if the element is
+  // not in the result.
+  const node_ptr<Traits>* eval_element(size_t offset, const node<Traits>& top) {
+    elements_.clear();
+    for (const expression_step& step : steps_) {
+      if (step.operand_) {
+        const node_ptr<Traits>* p = cursors_[offset + step.index_].node_;
+        elements_.push_back(contains(*p, top) ? p : nullptr);
+        continue;
+      }
+      const node_ptr<Traits>* r = elements_.back();
+      elements_.pop_back();
+      const node_ptr<Traits>*& l = elements_.back();
+      switch (step.operation_) {
+        case set_operation::set_union:
+          if (!l)
+            l = r;
+          break;
+        case set_operation::set_intersection:
+          if (l && !(r && same(*l, *r)))
+            l = nullptr;
+          break;
+        case set_operation::set_difference:
+          if (l && r && same(*l, *r))
+            l = nullptr;
+          break;
+        case set_operation::set_symmetric:
+          l = !l ? r : !r ? l : nullptr;
+          break;
+      }
+    }
+    return elements_.back();
+  }
+
+  bool contains(const node_ptr<Traits>& p, const node<Traits>& top) {
+    return p && (p.get() == &top || rank(env_, *p, top) == ranking::SAME);
+  }
+
+  bool same(const node_ptr<Traits>& l, const node_ptr<Traits>& r) {
+    return l == r || ranker_(env_, *l, *r) == ranking::SAME;
+  }
+
+  // Sets the cursors of the next level to the left or the right subtrees of
+  // the cursors of the current level.
+  void descend(size_t offset, const node<Traits>& top, bool left) {
+    for (size_t i = 0; i < operand_count_; ++i) {
+      cursor c = cursors_[offset + i];
+      if (contains(*c.node_, top))
+        c = child_cursor(c, left);
+      else
+        c.whole_ = false;
+      cursors_[offset + operand_count_ + i] = c;
+    }
+  }
+
+  const env<Traits>& env_;
+  const ranker_type ranker_;
+  const std::vector<expression_step>& steps_;
+  const size_t operand_count_;
+  std::vector<cursor> cursors_;
+  std::vector<shape> shapes_;
+  std::vector<const node_ptr<Traits>*> elements_;
+};
+
+// Merges any number of trees in one recursive pass. Like fused_evaluation the
+// trees are not split, but represented by cursors. The cursors of each step
+// are stored as a level on a stack, and trees that have no keys within the
+// range of a step are left out of the levels below it. Elements are matched by
+// keys, with precedence for elements from earlier trees.
+template <class Traits>
+struct multiway_merge {
+  typedef typename Traits::key_type key_type;
+  typedef subtree_cursor<Traits> cursor;
+
+  explicit multiway_merge(const env<Traits>& env) : env_(env) {}
+
+  void push(const node_ptr<Traits>& root) {
+    cursors_.push_back(root_cursor(root));
+  }
+
+  node_ptr<Traits> set_union() { return set_union(0, nullptr, nullptr); }
+
+  node_ptr<Traits> set_intersection() {
+    if (cursors_.empty())
+      return nullptr;
+    return set_intersection(0, nullptr, nullptr);
+  }
+
+  node_ptr<Traits> set_union(size_t first,
+                             const key_type* lo,
+                             const key_type* hi) {
+    size_t last = first;
+    for (size_t i = first; i < cursors_.size(); ++i) {
+      seek(env_, &cursors_[i], lo, hi);
+      if (*cursors_[i].node_)
+        cursors_[last++] = cursors_[i];
+    }
+    cursors_.resize(last);
+    if (first == last)
+      return nullptr;
+    if (shared(first, lo, hi))
+      return *cursors_[first].node_;
+
+    const node<Traits>* top = nullptr;
+    for (size_t i = first; i < last; ++i) {
+      const node<Traits>* p = cursors_[i].node_->get();
+      if (!top || rank(env_, *p, *top) == ranking::LEFT)
+        top = p;
+    }
+    const node_ptr<Traits>* element = nullptr;
+    for (size_t i = first; i < last; ++i) {
+      if (contains(*cursors_[i].node_, *top)) {
+        element = cursors_[i].node_;
+        break;
+      }
+    }
+
+    descend(first, last, *top, true);
+    node_ptr<Traits> left = set_union(last, lo, &top->key());
+    descend(first, last, *top, false);
+    node_ptr<Traits> right = set_union(last, &top->key(), hi);
+    cursors_.resize(last);
+    return make_result(element, std::move(left), std::move(right));
+  }
+
+  node_ptr<Traits> set_intersection(size_t first,
+                                    const key_type* lo,
+                                    const key_type* hi) {
+    size_t last = cursors_.size();
+    size_t driver = first;
+    for (size_t i = first; i < last; ++i) {
+      seek(env_, &cursors_[i], lo, hi);
+      if (!*cursors_[i].node_)
+        return nullptr;
+      if (size(*cursors_[i].node_) < size(*cursors_[driver].node_))
+        driver = i;
+    }
+    if (shared(first, lo, hi))
+      return *cursors_[first].node_;
+
+    // The root of the smallest subtree ranks above all keys of the result.
+    const node<Traits>& top = **cursors_[driver].node_;
+    const node_ptr<Traits>* element = nullptr;
+    for (size_t i = first; i < last; ++i) {
+      const node_ptr<Traits>* p = find(*cursors_[i].node_, top.key());
+      if (!p) {
+        element = nullptr;
+        break;
+      }
+      if (!element)
+        element = p;
+    }
+
+    descend(first, last, top, true);
+    node_ptr<Traits> left = set_intersection(last, lo, &top.key());
+    descend(first, last, top, false);
+    node_ptr<Traits> right = set_intersection(last, &top.key(), hi);
+    cursors_.resize(last);
+    return make_result(element, std::move(left), std::move(right));
+  }
+
+  // Tests if all cursors of a level cover the same whole subtree.
+  bool shared(size_t first, const key_type* lo, const key_type* hi) {
+    for (size_t i = first + 1; i < cursors_.size(); ++i) {
+      if (*cursors_[i].node_ != *cursors_[first].node_)
+        return false;
+    }
+    return whole(env_, &cursors_[first], lo, hi);
+  }
+
+  bool contains(const node_ptr<Traits>& p, const node<Traits>& top) {
+    return p.get() == &top || rank(env_, *p, top) == ranking::SAME;
+  }
+
+  const node_ptr<Traits>* find(const node_ptr<Traits>& root,
+                               const key_type& key) {
+    const node_ptr<Traits>* p = &root;
+    while (*p) {
+      if (env_.compare(key, (*p)->key()))
+        p = &(*p)->left_;
+      else if (env_.compare((*p)->key(), key))
+        p = &(*p)->right_;
+      else
+        return p;
+    }
+    return nullptr;
+  }
+
+  // Pushes a level with the left or the right subtrees of the cursors of the
+  // current level.
+  void descend(size_t first, size_t last, const node<Traits>& top, bool left) {
+    cursors_.resize(last);
+    for (size_t i = first; i < last; ++i) {
+      cursor c = cursors_[i];
+      if (contains(*c.node_, top))
+        c = child_cursor(c, left);
+      else
+        c.whole_ = false;
+      cursors_.push_back(c);
+    }
+  }
+
+  node_ptr<Traits> make_result(const node_ptr<Traits>* element,
+                               node_ptr<Traits> left,
+                               node_ptr<Traits> right) {
+    if (!element)
+      return join(env_, std::move(left), std::move(right));
+    if ((*element)->left_ == left && (*element)->right_ == right)
+      return *element;
+    return make_node(env_, **element, std::move(left), std::move(right));
+  }
+
+  const env<Traits>& env_;
+  std::vector<cursor> cursors_;
+};
+
+// Cursors to the left and right subtrees of the root of a cursor.
+template <class Traits>
+std::pair<subtree_cursor<Traits>, subtree_cursor<Traits>> children(
+    const subtree_cursor<Traits>& c) {
+  return {child_cursor(c, true), child_cursor(c, false)};
+}
+
+// Counts the elements that are in both of two trees, within the key range of
+// the current step. Like the merge kernels the recursion follows the root that
+// ranks highest, and subtrees shared by both trees are counted by their sizes,
+// but the trees are represented by cursors so that no nodes are created.
+template <class Traits, class Rank>
+size_t intersection_size(const env<Traits>& env,
+                         Rank ranker,
+                         subtree_cursor<Traits> left,
+                         subtree_cursor<Traits> right,
+                         const typename Traits::key_type* lo,
+                         const typename Traits::key_type* hi) {
+  seek(env, &left, lo, hi);
+  seek(env, &right, lo, hi);
+  if (!*left.node_ || !*right.node_)
+    return 0;
+  if (*left.node_ == *right.node_ && whole(env, &left, lo, hi))
+    return size(*left.node_);
+
+  const node<Traits>& l = **left.node_;
+  const node<Traits>& r = **right.node_;
+  switch (rank(env, l, r)) {
+    case ranking::LEFT: {
+      auto c = children(left);
+      right.whole_ = false;
+      return intersection_size(env, ranker, c.first, right, lo, &l.key()) +
+             intersection_size(env, ranker, c.second, right, &l.key(), hi);
+    }
+    case ranking::RIGHT: {
+      auto c = children(right);
+      left.whole_ = false;
+      return intersection_size(env, ranker, left, c.first, lo, &r.key()) +
+             intersection_size(env, ranker, left, c.second, &r.key(), hi);
+    }
+    default: {
+      auto lc = children(left);
+      auto rc = children(right);
+      return (ranker(env, l, r) == ranking::SAME ? 1 : 0) +
+             intersection_size(env, ranker, lc.first, rc.first, lo, &l.key()) +
+             intersection_size(env, ranker, lc.second, rc.second, &l.key(),
+                               hi);
+    }
+  }
+}
+
+template <class Traits, class Rank>
+size_t intersection_size(const env<Traits>& env,
+                         Rank ranker,
+                         const node_ptr<Traits>& left,
+                         const node_ptr<Traits>& right) {
+  if (left == right)
+    return size(left);
+  return intersection_size(env, ranker, root_cursor(left), root_cursor(right),
+                           nullptr, nullptr);
+}
+
+// Tests if two trees have an element in common, within the key range of the
+// current step, by a simultaneous descent that creates no nodes.
+template <class Traits, class Rank>
+bool intersects(const env<Traits>& env,
+                Rank ranker,
+                subtree_cursor<Traits> left,
+                subtree_cursor<Traits> right,
+                const typename Traits::key_type* lo,
+                const typename Traits::key_type* hi) {
+  seek(env, &left, lo, hi);
+  seek(env, &right, lo, hi);
+  if (!*left.node_ || !*right.node_)
+    return false;
+  if (*left.node_ == *right.node_)
+    return true;
+
+  const node<Traits>& l = **left.node_;
+  const node<Traits>& r = **right.node_;
+  switch (rank(env, l, r)) {
+    case ranking::LEFT: {
+      auto c = children(left);
+      right.whole_ = false;
+      return intersects(env, ranker, c.first, right, lo, &l.key()) ||
+             intersects(env, ranker, c.second, right, &l.key(), hi);
+    }
+    case ranking::RIGHT: {
+      auto c = children(right);
+      left.whole_ = false;
+      return intersects(env, ranker, left, c.first, lo, &r.key()) ||
+             intersects(env, ranker, left, c.second, &r.key(), hi);
+    }
+    default: {
+      if (ranker(env, l, r) == ranking::SAME)
+        return true;
+      auto lc = children(left);
+      auto rc = children(right);
+      return intersects(env, ranker, lc.first, rc.first, lo, &l.key()) ||
+             intersects(env, ranker, lc.second, rc.second, &l.key(), hi);
+    }
+  }
+}
+
+template <class Traits, class Rank>
+bool intersects(const env<Traits>& env,
+                Rank ranker,
+                const node_ptr<Traits>& left,
+                const node_ptr<Traits>& right) {
+  if (!left || !right)
+    return false;
+  if (left == right)
+    return true;
+  return intersects(env, ranker, root_cursor(left), root_cursor(right),
+                    nullptr, nullptr);
+}
+
+// Tests if the left tree includes all elements of the right tree, within the
+// key range of the current step, by a simultaneous descent that creates no
+// nodes.
+template <class Traits, class Rank>
+bool includes(const env<Traits>& env,
+              Rank ranker,
+              subtree_cursor<Traits> left,
+              subtree_cursor<Traits> right,
+              const typename Traits::key_type* lo,
+              const typename Traits::key_type* hi) {
+  seek(env, &right, lo, hi);
+  if (!*right.node_)
+    return true;
+  seek(env, &left, lo, hi);
+  if (!*left.node_)
+    return false;
+  if (*left.node_ == *right.node_ && whole(env, &right, lo, hi))
+    return true;
+  if (left.whole_ && right.whole_ && size(*left.node_) < size(*right.node_))
+    return false;
+
+  const node<Traits>& l = **left.node_;
+  const node<Traits>& r = **right.node_;
+  switch (rank(env, l, r)) {
+    case ranking::LEFT: {
+      auto c = children(left);
+      right.whole_ = false;
+      return includes(env, ranker, c.first, right, lo, &l.key()) &&
+             includes(env, ranker, c.second, right, &l.key(), hi);
+    }
+    case ranking::RIGHT: {
+      // The root of the right tree ranks above all keys of the left tree.
+      return false;
+    }
+    default: {
+      if (ranker(env, l, r) != ranking::SAME)
+        return false;
+      auto lc = children(left);
+      auto rc = children(right);
+      return includes(env, ranker, lc.first, rc.first, lo, &l.key()) &&
+             includes(env, ranker, lc.second, rc.second, &l.key(), hi);
+    }
+  }
+}
+
+template <class Traits, class Rank>
+bool includes(const env<Traits>& env,
+              Rank ranker,
+              const node_ptr<Traits>& left,
+              const node_ptr<Traits>& right) {
+  if (left == right || !right)
+    return true;
+  if (size(left) < size(right))
+    return false;
+  return includes(env, ranker, root_cursor(left), root_cursor(right), nullptr,
+                  nullptr);
+}
+
+template <class Traits, class InputIterator>
+node_ptr<Traits> make_node(const env<Traits>& env,
+                           InputIterator* first,
+                           InputIterator last,
+                           size_t max_depth) {
+  if (*first == last)
+    return nullptr;
+  node_ptr<Traits> root = make_node(env, **first);
+  ++*first;
+  for (size_t depth = 0; depth < max_depth; ++depth) {
+    node_ptr<Traits> branch = make_node(env, first, last, depth);
+    if (!branch)
+      break;
+    root = set_union(env, std::move(root), std::move(branch));
+  }
+  return root;
 }
 
 template <class Traits, class InputIterator>
@@ -617,6 +1964,42 @@ node_ptr<Traits> make_node(const env<Traits>& env,
   return make_node(env, &it, last, std::numeric_limits<size_t>::max());
 }
 
+// Builds a tree from a sorted range of unique elements in linear time.
+//
+// Elements are added along the right spine of the tree, kept on a stack of
+// nodes whose right subtrees are not yet known. Nodes that rank below a new
+// element are popped and created with their final children, which become the
+// left subtree of the new element. Every node is therefore created once.
+template <class Traits, class InputIterator>
+node_ptr<Traits> make_sorted_node(const env<Traits>& env,
+                                  InputIterator first,
+                                  InputIterator last) {
+  struct pending {
+    typename Traits::value_type value_;
+    size_t priority_;
+    node_ptr<Traits> left_;
+  };
+  std::vector<pending> stack;
+  for (; first != last; ++first) {
+    assert(stack.empty() || env.compare(stack.back().value_, *first));
+    size_t p = priority(env, *first);
+    node_ptr<Traits> left;
+    while (!stack.empty() && p < stack.back().priority_) {
+      left = make_node(env, stack.back().value_, std::move(stack.back().left_),
+                       std::move(left));
+      stack.pop_back();
+    }
+    stack.push_back({*first, p, std::move(left)});
+  }
+  node_ptr<Traits> root;
+  while (!stack.empty()) {
+    root = make_node(env, stack.back().value_, std::move(stack.back().left_),
+                     std::move(root));
+    stack.pop_back();
+  }
+  return root;
+}
+
 template <class Traits, class NodePtr>
 size_t add(const env<Traits>& env, node_ptr<Traits>* p, NodePtr&& q) {
   size_t n = size(*p);
@@ -669,6 +2052,14 @@ size_t insert(const env<Traits>& env,
   return add(env, p, make_node(env, first, last));
 }
 
+template <class Traits, class InputIterator>
+size_t insert_sorted(const env<Traits>& env,
+                     node_ptr<Traits>* p,
+                     InputIterator first,
+                     InputIterator last) {
+  return add(env, p, make_sorted_node(env, first, last));
+}
+
 template <class Traits, class InputIterator>
 void assign(const env<Traits>& env,
             node_ptr<Traits>* p,
@@ -746,6 +2137,220 @@ node_ptr<Traits> head(const env<Traits>& env,
                                                last - size((*p)->left_) - 1));
 }
 
+template <class Traits>
+const typename Traits::key_type& key_of(
+    const env<Traits, set_tag>& env,
+    const typename Traits::value_type& value) {
+  env.silence_unused_warning();
+  return value;
+}
+
+template <class Traits>
+struct transient_node;
+
+// A subtree of a transient tree. The subtree is either owned by the transient
+// tree and updated in place, or a shared node that is copied into an owned
+// node before it is updated.
+template <class Traits>
+struct transient_ptr {
+  explicit operator bool() const { return owned_ || shared_; }
+
+  std::unique_ptr<transient_node<Traits>> owned_;
+  node_ptr<Traits> shared_;
+};
+
+template <class Traits>
+struct transient_node {
+  transient_node(const typename Traits::value_type& value, size_t priority)
+      : value_(value), priority_(priority) {}
+
+  typename Traits::value_type value_;
+  size_t priority_;
+  transient_ptr<Traits> left_;
+  transient_ptr<Traits> right_;
+};
+
+// Returns the owned node of a subtree, copying the root of a shared subtree
+// into a new owned node if needed.
+template <class Traits>
+transient_node<Traits>* thaw(const env<Traits>& env, transient_ptr<Traits>* p) {
+  if (!p->owned_) {
+    const node_ptr<Traits>& q = p->shared_;
+    p->owned_.reset(new transient_node<Traits>(q->value(), q->priority()));
+    p->owned_->left_.shared_ = q->left_;
+    p->owned_->right_.shared_ = q->right_;
+    reset(env, &p->shared_);
+  }
+  return p->owned_.get();
+}
+
+template <class Traits>
+const typename Traits::key_type& key_of(const env<Traits>& env,
+                                        const transient_ptr<Traits>& p) {
+  return p.owned_ ? key_of(env, p.owned_->value_) : p.shared_->key();
+}
+
+template <class Traits>
+size_t priority(const transient_ptr<Traits>& p) {
+  return p.owned_ ? p.owned_->priority_ : p.shared_->priority();
+}
+
+// Tests if a root with the given key and priority ranks above another root,
+// with the same order as rank().
+template <class Traits>
+bool ranks_above(const env<Traits>& env,
+                 const typename Traits::key_type& left_key,
+                 size_t left_priority,
+                 const typename Traits::key_type& right_key,
+                 size_t right_priority) {
+  if (left_priority != right_priority)
+    return left_priority < right_priority;
+  return env.compare(left_key, right_key);
+}
+
+template <class Traits>
+const typename Traits::value_type* find(const env<Traits>& env,
+                                        const transient_ptr<Traits>* p,
+                                        const typename Traits::key_type& key) {
+  while (p->owned_) {
+    const transient_node<Traits>* n = p->owned_.get();
+    if (env.compare(key, key_of(env, n->value_)))
+      p = &n->left_;
+    else if (env.compare(key_of(env, n->value_), key))
+      p = &n->right_;
+    else
+      return &n->value_;
+  }
+  const node<Traits>* q = p->shared_.get();
+  while (q) {
+    if (env.compare(key, q->key()))
+      q = q->left_.get();
+    else if (env.compare(q->key(), key))
+      q = q->right_.get();
+    else
+      return &q->value();
+  }
+  return nullptr;
+}
+
+// Finds the owned node with the given key, which must be contained in the
+// tree, and returns a pointer to the subtree it is the root of. Nodes on the
+// path are made owned.
+template <class Traits>
+transient_ptr<Traits>* thaw_path(const env<Traits>& env,
+                                 transient_ptr<Traits>* p,
+                                 const typename Traits::key_type& key) {
+  while (true) {
+    transient_node<Traits>* n = thaw(env, p);
+    if (env.compare(key, key_of(env, n->value_)))
+      p = &n->left_;
+    else if (env.compare(key_of(env, n->value_), key))
+      p = &n->right_;
+    else
+      return p;
+  }
+}
+
+template <class Traits>
+void split(const env<Traits>& env,
+           transient_ptr<Traits> p,
+           const typename Traits::key_type& key,
+           transient_ptr<Traits>* left,
+           transient_ptr<Traits>* right) {
+  while (p) {
+    transient_node<Traits>* n = thaw(env, &p);
+    if (env.compare(key_of(env, n->value_), key)) {
+      *left = std::move(p);
+      left = &n->right_;
+      p = std::move(n->right_);
+    } else {
+      *right = std::move(p);
+      right = &n->left_;
+      p = std::move(n->left_);
+    }
+  }
+  *left = transient_ptr<Traits>();
+  *right = transient_ptr<Traits>();
+}
+
+template <class Traits>
+transient_ptr<Traits> join(const env<Traits>& env,
+                           transient_ptr<Traits> left,
+                           transient_ptr<Traits> right) {
+  transient_ptr<Traits> root;
+  transient_ptr<Traits>* p = &root;
+  while (left && right) {
+    if (ranks_above(env, key_of(env, left), priority(left), key_of(env, right),
+                    priority(right))) {
+      transient_node<Traits>* n = thaw(env, &left);
+      *p = std::move(left);
+      p = &n->right_;
+      left = std::move(n->right_);
+    } else {
+      transient_node<Traits>* n = thaw(env, &right);
+      *p = std::move(right);
+      p = &n->left_;
+      right = std::move(n->left_);
+    }
+  }
+  *p = left ? std::move(left) : std::move(right);
+  return root;
+}
+
+template <class Traits>
+size_t insert(const env<Traits>& env,
+              transient_ptr<Traits>* p,
+              const typename Traits::value_type& value) {
+  const typename Traits::key_type& key = key_of(env, value);
+  if (find(env, p, key))
+    return 0;
+  size_t pri = priority(env, value);
+  while (*p && ranks_above(env, key_of(env, *p), priority(*p), key, pri)) {
+    transient_node<Traits>* n = thaw(env, p);
+    p = env.compare(key, key_of(env, n->value_)) ? &n->left_ : &n->right_;
+  }
+  std::unique_ptr<transient_node<Traits>> n(
+      new transient_node<Traits>(value, pri));
+  split(env, std::move(*p), key, &n->left_, &n->right_);
+  p->owned_ = std::move(n);
+  return 1;
+}
+
+// Replaces the contained element with the same key as a given value.
+template <class Traits>
+bool assign(const env<Traits>& env,
+            transient_ptr<Traits>* p,
+            const typename Traits::value_type& value) {
+  const typename Traits::value_type* q = find(env, p, key_of(env, value));
+  if (!q || env.equal(*q, value))
+    return false;
+  thaw_path(env, p, key_of(env, value))->owned_->value_ = value;
+  return true;
+}
+
+template <class Traits>
+size_t erase(const env<Traits>& env,
+             transient_ptr<Traits>* p,
+             const typename Traits::key_type& key) {
+  if (!find(env, p, key))
+    return 0;
+  p = thaw_path(env, p, key);
+  transient_node<Traits>* n = p->owned_.get();
+  *p = join(env, std::move(n->left_), std::move(n->right_));
+  return 1;
+}
+
+// Creates shared nodes for all owned nodes in a transient tree.
+template <class Traits>
+node_ptr<Traits> persist(const env<Traits>& env, transient_ptr<Traits> p) {
+  if (!p.owned_)
+    return std::move(p.shared_);
+  transient_node<Traits>& n = *p.owned_;
+  node_ptr<Traits> left = persist(env, std::move(n.left_));
+  node_ptr<Traits> right = persist(env, std::move(n.right_));
+  return make_node(env, n.value_, std::move(left), std::move(right));
+}
+
 template <class T, class Compare, class Hash, class Equal>
 struct set_traits {
   typedef set_tag category;
@@ -769,9 +2374,9 @@ struct node<Traits, set_tag> {
        ptr_type right,
        size_t h)
       : reference_count_(1),
+        size_(node_size(sz)),
         value_(value),
-        priority_(priority),
-        size_(sz),
+        priority_(static_cast<node_count_type>(priority)),
         hash_(h),
         left_(std::move(left)),
         right_(std::move(right)) {}
@@ -783,9 +2388,11 @@ struct node<Traits, set_tag> {
                          size_t priority) {
     size_t sz = 1 + internal::size(left) + internal::size(right);
     size_t h = hash_combine(hash(left), hash(right), priority);
-    std::unique_ptr<node> p(
-        new node(value, priority, sz, std::move(left), std::move(right), h));
-    return get_unique_node(env, std::move(p));
+    return get_unique_node(env, allocate_node<Traits>([&](void* p) {
+                             return new (p) node(value, priority, sz,
+                                                 std::move(left),
+                                                 std::move(right), h);
+                           }));
   }
 
   const key_type& key() const { return value_; }
@@ -793,11 +2400,11 @@ struct node<Traits, set_tag> {
   size_t priority() const { return priority_; }
   size_t size() const { return size_; }
 
-  std::atomic<size_t> reference_count_;
+  std::atomic<node_count_type> reference_count_;
+  const node_count_type size_;
   node* next_;
   const value_type value_;
-  const size_t priority_;
-  const size_t size_;
+  const node_count_type priority_;
   const size_t hash_;
   const ptr_type left_;
   const ptr_type right_;
@@ -807,39 +2414,104 @@ template <class Traits>
 struct env<Traits, set_tag> : env_base<Traits> {
   typedef typename Traits::provider provider_type;
   typedef typename Traits::key_type key_type;
-  typedef hash_table<Traits> hash_table_type;
 
   using env_base<Traits>::env_base;
   using env_base<Traits>::provider_;
 
   static bool compare(const key_type& lhs, const key_type& rhs) {
+    ++env_base<Traits>::get_call_counts().comparisons_;
     return provider_->key_comp()(lhs, rhs);
   }
 
   static bool equal(const key_type& lhs, const key_type& rhs) {
+    ++env_base<Traits>::get_call_counts().equality_tests_;
     return provider_->key_eq()(lhs, rhs);
   }
 
-  static size_t hash(const key_type& key) { return provider_->key_hash()(key); }
+  static size_t hash(const key_type& key) {
+    ++env_base<Traits>::get_call_counts().hashes_;
+    return provider_->key_hash()(key);
+  }
 };
 
-}  // namespace internal
+// Gives algorithms that are defined outside of the container classes access
+// to the nodes of containers.
+struct access {
+  template <class Container>
+  static const typename Container::node_ptr& node(const Container& container) {
+    return container.node_;
+  }
 
-template <class Traits>
-struct iterator {
-  typedef internal::node<Traits> node_type;
-  typedef typename Traits::container container_type;
+  template <class Container>
+  static Container make(typename Container::provider_ptr provider,
+                        typename Container::node_ptr node) {
+    return Container(std::move(provider), std::move(node));
+  }
 
-  typedef std::ptrdiff_t difference_type;
-  typedef const typename Traits::value_type value_type;
-  typedef const value_type* pointer;
-  typedef const value_type& reference;
-  typedef std::bidirectional_iterator_tag iterator_category;
+  template <class Map>
+  static auto rank() -> decltype(&Map::rank) {
+    return &Map::rank;
+  }
 
-  iterator() : container_(nullptr), pos_(0), node_(nullptr) {}
+  template <class Container>
+  struct traits {
+    typedef typename Container::traits type;
+  };
+};
 
-  iterator(const container_type* container,
-           size_t pos,
+// Traversal stack of an iterator. Entries are kept in a fixed-size ring
+// buffer inside the iterator so that iterators never allocate memory and can be
+// copied with their stacks. When the buffer is full the bottom entry is
+// dropped, which makes the iterator descend from the root again when it later
+// runs out of entries.
+template <class Node>
+struct node_stack {
+  node_stack() : begin_(0), size_(0) {}
+
+  bool empty() const { return size_ == 0; }
+
+  const Node* back() const { return nodes_[(begin_ + size_ - 1) & mask_]; }
+
+  void push_back(const Node* p) {
+    if (size_ == capacity_) {
+      begin_ = (begin_ + 1) & mask_;
+      --size_;
+    }
+    nodes_[(begin_ + size_) & mask_] = p;
+    ++size_;
+  }
+
+  void pop_back() { --size_; }
+
+  void clear() { size_ = 0; }
+
+  // Number of entries. Must be power of two.
+  static constexpr size_t capacity_ = 1 << 5;
+  static constexpr size_t mask_ = capacity_ - 1;
+
+  const Node* nodes_[capacity_];
+  size_t begin_;
+  size_t size_;
+};
+
+}  // namespace internal
+
+template <class Traits>
+struct iterator {
+  typedef internal::node<Traits> node_type;
+  typedef typename Traits::container container_type;
+
+  typedef std::ptrdiff_t difference_type;
+  typedef const typename Traits::value_type value_type;
+  typedef const value_type* pointer;
+  typedef const value_type& reference;
+  typedef std::random_access_iterator_tag iterator_category;
+
+  iterator()
+      : container_(nullptr), pos_(0), node_(nullptr), decrementing_(false) {}
+
+  iterator(const container_type* container,
+           size_t pos,
            const node_type* node = nullptr)
       : container_(container), pos_(pos), node_(node), decrementing_(false) {}
 
@@ -850,12 +2522,6 @@ struct iterator {
         node_(p.first),
         decrementing_(false) {}
 
-  iterator(const iterator& other)
-      : container_(other.container_),
-        pos_(other.pos_),
-        node_(other.node_),
-        decrementing_(false) {}
-
   reference operator*() const { return find_node()->value(); }
   pointer operator->() const { return &find_node()->value(); }
 
@@ -865,13 +2531,17 @@ struct iterator {
   }
 
   iterator operator++(int) {
-    iterator it(container_, pos_, node_);
+    iterator it(*this);
     *this += 1;
     return it;
   }
 
+  reference operator[](difference_type k) const { return *(*this + k); }
+
   iterator operator+(difference_type k) const {
-    return iterator(container_, pos_ + k);
+    iterator it(*this);
+    it += k;
+    return it;
   }
 
   iterator& operator+=(difference_type k) {
@@ -885,13 +2555,19 @@ struct iterator {
   }
 
   iterator operator--(int) {
-    iterator it(container_, pos_, node_);
+    iterator it(*this);
     *this -= 1;
     return it;
   }
 
   iterator operator-(difference_type k) const {
-    return iterator(container_, pos_ - k);
+    iterator it(*this);
+    it -= k;
+    return it;
+  }
+
+  difference_type operator-(const iterator& other) const {
+    return pos_ - other.pos_;
   }
 
   iterator& operator-=(difference_type k) {
@@ -907,19 +2583,6 @@ struct iterator {
     std::swap(decrementing_, other.decrementing_);
   }
 
-  iterator& operator=(const iterator& other) {
-    container_ = other.container_;
-    pos_ = other.pos_;
-    node_ = other.node_;
-    stack_.clear();
-    return *this;
-  }
-
-  iterator& operator=(iterator&& other) {
-    swap(other);
-    return *this;
-  }
-
   bool operator==(const iterator& other) const { return pos_ == other.pos_; }
   bool operator!=(const iterator& other) const { return pos_ != other.pos_; }
   bool operator<(const iterator& other) const { return pos_ < other.pos_; }
@@ -927,110 +2590,1345 @@ struct iterator {
   bool operator>(const iterator& other) const { return pos_ > other.pos_; }
   bool operator>=(const iterator& other) const { return pos_ >= other.pos_; }
 
-  void increment() {
-    ++pos_;
-    if (decrementing_) {
-      stack_.clear();
-      decrementing_ = false;
-    }
-    if (stack_.empty()) {
-      size_t k = pos_;
-      node_ = container_->node_.get();
-      do {
-        while (k > size(node_->left_)) {
-          k -= size(node_->left_) + 1;
-          node_ = node_->right_.get();
-        }
-        while (k < size(node_->left_)) {
-          stack_.push_back(node_);
-          node_ = node_->left_.get();
-        }
-      } while (k != size(node_->left_));
-      return;
-    }
-    if (node_->right_) {
-      node_ = node_->right_.get();
-      while (node_->left_) {
-        stack_.push_back(node_);
-        node_ = node_->left_.get();
-      }
-    } else {
-      node_ = stack_.back();
-      stack_.pop_back();
-    }
+  // Moves forward to a given position. The traversal stack holds the
+  // ancestors whose left subtrees contain the current node, so the stack is
+  // walked upwards until the position is in the right subtree of the current
+  // node, which takes O(log d) expected time to move d positions.
+  void seek_forward(size_t pos) {
+    if (decrementing_) {
+      stack_.clear();
+      decrementing_ = false;
+    }
+    const node_type* p = node_;
+    size_t k = pos - pos_;
+    pos_ = pos;
+    while (p && k > size(p->right_)) {
+      if (stack_.empty()) {
+        p = nullptr;
+      } else {
+        k -= size(p->right_) + 1;
+        p = stack_.back();
+        stack_.pop_back();
+      }
+    }
+    if (!p) {
+      p = container_->node_.get();
+      k = pos;
+    } else if (k) {
+      p = p->right_.get();
+      k -= 1;
+    } else {
+      node_ = p;
+      return;
+    }
+    while (true) {
+      while (k > size(p->left_)) {
+        k -= size(p->left_) + 1;
+        p = p->right_.get();
+      }
+      if (k == size(p->left_))
+        break;
+      stack_.push_back(p);
+      p = p->left_.get();
+    }
+    node_ = p;
+  }
+
+  // Moves backward to a given position. Mirrors seek_forward() with a stack of
+  // the ancestors whose right subtrees contain the current node.
+  void seek_backward(size_t pos) {
+    if (!decrementing_) {
+      stack_.clear();
+      decrementing_ = true;
+    }
+    const node_type* p = node_;
+    size_t k = pos_ - pos;
+    pos_ = pos;
+    while (p && k > size(p->left_)) {
+      if (stack_.empty()) {
+        p = nullptr;
+      } else {
+        k -= size(p->left_) + 1;
+        p = stack_.back();
+        stack_.pop_back();
+      }
+    }
+    if (!p) {
+      p = container_->node_.get();
+      k = pos;
+    } else if (k) {
+      k = size(p->left_) - k;
+      p = p->left_.get();
+    } else {
+      node_ = p;
+      return;
+    }
+    while (true) {
+      while (k < size(p->left_))
+        p = p->left_.get();
+      if (k == size(p->left_))
+        break;
+      k -= size(p->left_) + 1;
+      stack_.push_back(p);
+      p = p->right_.get();
+    }
+    node_ = p;
+  }
+
+  void reset(size_t pos) {
+    if (pos == pos_)
+      return;
+    if (pos >= size(container_->node_)) {
+      pos_ = pos;
+      node_ = nullptr;
+      stack_.clear();
+    } else if (pos > pos_) {
+      seek_forward(pos);
+    } else {
+      seek_backward(pos);
+    }
+  }
+
+  const node_type* find_node() const {
+    assert(pos_ < size(container_->node_));
+    if (!node_)
+      node_ = at_index(container_->node_.get(), pos_);
+    return node_;
+  }
+
+  const container_type* container_;
+  size_t pos_;
+  mutable const node_type* node_;
+  internal::node_stack<node_type> stack_;
+  bool decrementing_;
+};
+
+template <class Traits>
+iterator<Traits> operator+(std::ptrdiff_t k, const iterator<Traits>& it) {
+  return it + k;
+}
+
+template <class Traits>
+std::ptrdiff_t distance(const iterator<Traits>& from,
+                        const iterator<Traits>& to) {
+  return to.pos_ - from.pos_;
+}
+
+// Iterates in reverse order by keeping an iterator to the referenced element,
+// so that advancing steps backwards along the traversal stack of the iterator.
+template <class Traits>
+struct reverse_iterator {
+  typedef iterator<Traits> iterator_type;
+  typedef typename iterator_type::container_type container_type;
+
+  typedef typename iterator_type::difference_type difference_type;
+  typedef typename iterator_type::value_type value_type;
+  typedef typename iterator_type::pointer pointer;
+  typedef typename iterator_type::reference reference;
+  typedef typename iterator_type::iterator_category iterator_category;
+
+  reverse_iterator() {}
+
+  explicit reverse_iterator(const iterator_type& base)
+      : it_(base.container_, base.pos_ - 1) {}
+
+  iterator_type base() const { return iterator_type(it_.container_, pos()); }
+
+  reference operator*() const { return *it_; }
+  pointer operator->() const { return it_.operator->(); }
+
+  reverse_iterator& operator++() {
+    --it_;
+    return *this;
+  }
+
+  reverse_iterator operator++(int) {
+    reverse_iterator it(*this);
+    --it_;
+    return it;
+  }
+
+  reference operator[](difference_type k) const { return it_[-k]; }
+
+  reverse_iterator operator+(difference_type k) const {
+    reverse_iterator it(*this);
+    it += k;
+    return it;
+  }
+
+  reverse_iterator& operator+=(difference_type k) {
+    it_ -= k;
+    return *this;
+  }
+
+  reverse_iterator& operator--() {
+    ++it_;
+    return *this;
+  }
+
+  reverse_iterator operator--(int) {
+    reverse_iterator it(*this);
+    ++it_;
+    return it;
+  }
+
+  reverse_iterator operator-(difference_type k) const {
+    reverse_iterator it(*this);
+    it -= k;
+    return it;
+  }
+
+  difference_type operator-(const reverse_iterator& other) const {
+    return other.pos() - pos();
+  }
+
+  reverse_iterator& operator-=(difference_type k) {
+    it_ += k;
+    return *this;
+  }
+
+  void swap(reverse_iterator& other) { it_.swap(other.it_); }
+
+  // Positions are compared as positions of base iterators, where the end of
+  // the reversed range is at position zero.
+  bool operator==(const reverse_iterator& other) const {
+    return pos() == other.pos();
+  }
+  bool operator!=(const reverse_iterator& other) const {
+    return pos() != other.pos();
+  }
+  bool operator<(const reverse_iterator& other) const {
+    return pos() > other.pos();
+  }
+  bool operator<=(const reverse_iterator& other) const {
+    return pos() >= other.pos();
+  }
+  bool operator>(const reverse_iterator& other) const {
+    return pos() < other.pos();
+  }
+  bool operator>=(const reverse_iterator& other) const {
+    return pos() <= other.pos();
+  }
+
+  size_t pos() const { return it_.pos_ + 1; }
+
+  iterator_type it_;
+};
+
+template <class Traits>
+reverse_iterator<Traits> operator+(std::ptrdiff_t k,
+                                   const reverse_iterator<Traits>& it) {
+  return it + k;
+}
+
+template <class Traits>
+std::ptrdiff_t distance(const reverse_iterator<Traits>& from,
+                        const reverse_iterator<Traits>& to) {
+  return from.pos() - to.pos();
+}
+
+/// @endcond HIDDEN_SYMBOLS
+
+/**
+ * A transient is a mutable builder for a set or a map that applies batches of
+ * updates without sharing the nodes it updates.
+ *
+ * Nodes that are updated are copied once into nodes owned by the transient and
+ * later updates of the same nodes are applied in place, without involving the
+ * node table of the provider. The updated nodes are shared with other
+ * containers in a single pass when persistent() is called. Nodes that are not
+ * updated remain shared with the container the transient was created from.
+ *
+ * A transient is not thread safe and should be used by one thread at a time.
+ **/
+template <class Traits>
+class transient {
+  typedef internal::env<Traits> env_type;
+
+ public:
+  typedef typename Traits::key_type key_type;
+  typedef typename Traits::value_type value_type;
+  typedef typename Traits::container container_type;
+  typedef std::shared_ptr<typename Traits::provider> provider_ptr;
+
+  /**
+   * Creates a new transient with the content of a given container.
+   *
+   * @param container container with the initial content
+   *
+   * Complexity: Constant in time and memory.
+   **/
+  explicit transient(const container_type& container)
+      : provider_(container.provider()), size_(container.size()) {
+    root_.shared_ = internal::access::node(container);
+  }
+
+  /**
+   * Creates a new transient by moving content from another transient.
+   *
+   * Result is undefined if the other transient is used after content has been
+   * moved.
+   *
+   * @param other other transient
+   *
+   * Complexity: Constant in time and memory.
+   **/
+  transient(transient&& other)
+      : provider_(other.provider_),
+        root_(std::move(other.root_)),
+        size_(other.size_) {
+    other.size_ = 0;
+  }
+
+  transient(const transient&) = delete;
+
+  ~transient() { clear(); }
+
+  /**
+   * Inserts an element.
+   *
+   * The new element is inserted if its key is not contained before.
+   *
+   * @param value element to insert
+   * @return the number of inserted elements
+   *
+   * Complexity: O(log n) expected time and O(log n) memory for the first
+   * update of every path in the tree, constant memory for later updates.
+   **/
+  size_t insert(const value_type& value) {
+    size_t n = internal::insert(env_type(provider_.get()), &root_, value);
+    size_ += n;
+    return n;
+  }
+
+  /**
+   * Inserts an element, replacing any contained element with the same key.
+   *
+   * For sets this is equivalent to insert().
+   *
+   * @param value element to insert
+   * @return true if the content was updated, false otherwise
+   *
+   * Complexity: O(log n) expected time and O(log n) memory for the first
+   * update of every path in the tree, constant memory for later updates.
+   **/
+  bool insert_or_assign(const value_type& value) {
+    if (insert(value))
+      return true;
+    return internal::assign(env_type(provider_.get()), &root_, value);
+  }
+
+  /**
+   * Erases the element with a given key.
+   *
+   * @param key key of the element to erase
+   * @return the number of erased elements
+   *
+   * Complexity: O(log n) expected time and O(log n) memory for the first
+   * update of every path in the tree, constant memory for later updates.
+   **/
+  size_t erase(const key_type& key) {
+    size_t n = internal::erase(env_type(provider_.get()), &root_, key);
+    size_ -= n;
+    return n;
+  }
+
+  /**
+   * Returns the number of elements with a given key.
+   *
+   * @param key key to search for
+   * @returns 1 if an element was found, otherwise 0
+   *
+   * Complexity: O(log n) expected time.
+   **/
+  size_t count(const key_type& key) const {
+    return internal::find(env_type(provider_.get()), &root_, key) ? 1 : 0;
+  }
+
+  /**
+   * Erases all elements.
+   *
+   * Complexity: Constant in time and memory, plus destruction of the nodes
+   * owned by this transient.
+   **/
+  void clear() {
+    if (root_) {
+      env_type env(provider_.get());
+      env.silence_unused_warning();
+      root_ = internal::transient_ptr<Traits>();
+      size_ = 0;
+    }
+  }
+
+  /**
+   * Returns a container with the content of this transient.
+   *
+   * The nodes owned by the transient are replaced by shared nodes, so the
+   * transient can continue to be used and later calls are cheap as long as
+   * no further updates are made.
+   *
+   * Let k be the number of nodes owned by the transient.
+   *
+   * Complexity: O(k) expected time and memory.
+   **/
+  container_type persistent() {
+    root_.shared_ =
+        internal::persist(env_type(provider_.get()), std::move(root_));
+    return internal::access::make<container_type>(provider_, root_.shared_);
+  }
+
+  /**
+   * Returns a shared pointer to the provider used by this transient.
+   **/
+  const provider_ptr& provider() const { return provider_; }
+
+  /**
+   * Tests if this transient is empty.
+   *
+   * Complexity: Constant in time.
+   **/
+  bool empty() const { return size_ == 0; }
+
+  /**
+   * Returns the number of elements in this transient.
+   *
+   * Complexity: Constant in time.
+   **/
+  size_t size() const { return size_; }
+
+ private:
+  const provider_ptr provider_;
+  internal::transient_ptr<Traits> root_;
+  size_t size_;
+};
+
+/**
+ * An expression is a lazily evaluated combination of sets or maps.
+ *
+ * Expressions are created by lazy() and combined with other expressions or
+ * containers with the same operators as the containers. The expression is
+ * evaluated when it is converted to a container, in a single pass over all
+ * operands that creates no intermediate containers.
+ *
+ * typedef confluent::map<Key, T> map;
+ *
+ * map merge(map A, map B, map C) {
+ *   map::expression_type a = A.lazy();
+ *   return (a - (a - B) - (a - C)) | (B - a) | (C - a);
+ * }
+ *
+ * evaluates the three-way merge without creating the nodes of the
+ * intermediate results.
+ *
+ * An expression keeps the content of its operands, so later updates of the
+ * containers it was created from do not change its result.
+ **/
+template <class Traits>
+class expression {
+  typedef internal::env<Traits> env_type;
+
+ public:
+  typedef typename Traits::container container_type;
+  typedef std::shared_ptr<typename Traits::provider> provider_ptr;
+
+  /**
+   * Creates a new expression with a given container as its only operand.
+   *
+   * @param container the operand
+   *
+   * Complexity: Constant in time and memory.
+   **/
+  explicit expression(const container_type& container)
+      : provider_(container.provider()),
+        operands_(1, internal::access::node(container)),
+        steps_(1, internal::expression_step{true, 0, {}}) {}
+
+  expression(const expression& other) = default;
+
+  expression(expression&& other) = default;
+
+  ~expression() {
+    if (!operands_.empty()) {
+      env_type env(provider_.get());
+      env.silence_unused_warning();
+      operands_.clear();
+    }
+  }
+
+  expression& operator=(expression other) {
+    swap(other);
+    return *this;
+  }
+
+  /**
+   * Swaps content of two expressions.
+   **/
+  void swap(expression& other) {
+    std::swap(provider_, other.provider_);
+    std::swap(operands_, other.operands_);
+    std::swap(steps_, other.steps_);
+  }
+
+  /**
+   * Returns an expression for the union of two expressions.
+   *
+   * Result is undefined if not both expressions are using the same provider.
+   **/
+  friend expression operator|(expression lhs, const expression& rhs) {
+    lhs.combine(internal::set_operation::set_union, rhs);
+    return lhs;
+  }
+
+  friend expression operator|(expression lhs, const container_type& rhs) {
+    return std::move(lhs) | expression(rhs);
+  }
+
+  friend expression operator|(const container_type& lhs,
+                              const expression& rhs) {
+    return expression(lhs) | rhs;
+  }
+
+  /**
+   * Returns an expression for the intersection of two expressions.
+   *
+   * Result is undefined if not both expressions are using the same provider.
+   **/
+  friend expression operator&(expression lhs, const expression& rhs) {
+    lhs.combine(internal::set_operation::set_intersection, rhs);
+    return lhs;
+  }
+
+  friend expression operator&(expression lhs, const container_type& rhs) {
+    return std::move(lhs) & expression(rhs);
+  }
+
+  friend expression operator&(const container_type& lhs,
+                              const expression& rhs) {
+    return expression(lhs) & rhs;
+  }
+
+  /**
+   * Returns an expression for the difference of two expressions.
+   *
+   * Result is undefined if not both expressions are using the same provider.
+   **/
+  friend expression operator-(expression lhs, const expression& rhs) {
+    lhs.combine(internal::set_operation::set_difference, rhs);
+    return lhs;
+  }
+
+  friend expression operator-(expression lhs, const container_type& rhs) {
+    return std::move(lhs) - expression(rhs);
+  }
+
+  friend expression operator-(const container_type& lhs,
+                              const expression& rhs) {
+    return expression(lhs) - rhs;
+  }
+
+  /**
+   * Returns an expression for the symmetric difference of two expressions.
+   *
+   * Only defined for sets, since maps have no symmetric difference.
+   *
+   * Result is undefined if not both expressions are using the same provider.
+   **/
+  friend expression operator^(expression lhs, const expression& rhs) {
+    static_assert(
+        std::is_same<typename Traits::category, internal::set_tag>::value,
+        "symmetric difference is only defined for sets");
+    lhs.combine(internal::set_operation::set_symmetric, rhs);
+    return lhs;
+  }
+
+  friend expression operator^(expression lhs, const container_type& rhs) {
+    return std::move(lhs) ^ expression(rhs);
+  }
+
+  friend expression operator^(const container_type& lhs,
+                              const expression& rhs) {
+    return expression(lhs) ^ rhs;
+  }
+
+  /**
+   * Evaluates this expression.
+   *
+   * @return a container with the result of the expression
+   *
+   * Let k be the number of operands.
+   * Let n be the total size of the operands.
+   * Let d be the size of the difference between the operands.
+   *
+   * Complexity: O(k * d * log(n/d)) expected time and O(d * log(n/d))
+   * expected memory.
+   **/
+  container_type eval() const {
+    env_type env(provider_.get());
+    internal::fused_evaluation<Traits> evaluation(
+        env, element_ranker(env), steps_, operands_.size());
+    return internal::access::make<container_type>(provider_,
+                                                  evaluation(operands_));
+  }
+
+  /**
+   * Evaluates this expression, see eval().
+   **/
+  operator container_type() const { return eval(); }
+
+  /**
+   * Returns a shared pointer to the provider used by this expression.
+   **/
+  const provider_ptr& provider() const { return provider_; }
+
+ private:
+  void combine(internal::set_operation operation, const expression& other) {
+    assert(provider_ == other.provider_);
+    size_t offset = operands_.size();
+    operands_.insert(operands_.end(), other.operands_.begin(),
+                     other.operands_.end());
+    for (internal::expression_step step : other.steps_) {
+      if (step.operand_)
+        step.index_ += offset;
+      steps_.push_back(step);
+    }
+    steps_.push_back(internal::expression_step{false, 0, operation});
+  }
+
+  provider_ptr provider_;
+  std::vector<internal::node_ptr<Traits>> operands_;
+  std::vector<internal::expression_step> steps_;
+};
+
+/// @cond HIDDEN_SYMBOLS
+
+namespace internal {
+
+// Erases the elements of a set that are contained in another set. Deltas of
+// maps erase elements by key, by an overload for map_tag in map.h.
+template <class Container>
+Container erase_keys(const Container& container,
+                     const Container& keys,
+                     set_tag) {
+  return container - keys;
+}
+
+}  // namespace internal
+
+/// @endcond
+
+/**
+ * A delta is the difference between two versions of a set or a map, as the
+ * elements added and the elements removed by the change from one version to
+ * the other.
+ *
+ * A delta can be applied to any container using the same provider, and
+ * composed with and inverted into other deltas. It holds containers of its own
+ * elements only and does not keep the versions it was computed from alive, so
+ * it can be stored and replayed by writing and reading the elements of
+ * added() and removed().
+ *
+ * For maps, an element whose mapped value was changed is both removed, with
+ * its old value, and added, with its new value. Removed elements of maps are
+ * erased by their keys when a delta is applied, whatever the mapped values.
+ **/
+template <class Traits>
+class delta {
+  typedef typename Traits::category category;
+
+ public:
+  typedef typename Traits::container container_type;
+
+  /**
+   * Creates a delta from added and removed elements.
+   *
+   * Result is undefined if not both containers are using the same provider.
+   *
+   * @param added elements added by the delta
+   * @param removed elements removed by the delta
+   *
+   * Complexity: Constant in time and memory.
+   **/
+  delta(container_type added, container_type removed)
+      : added_(std::move(added)), removed_(std::move(removed)) {
+    assert(added_.provider() == removed_.provider());
+  }
+
+  /**
+   * Computes the delta that changes one container into another.
+   *
+   * Result is undefined if not both containers are using the same provider.
+   *
+   * @param from the old version
+   * @param to the new version
+   *
+   * Let n be the size of the larger container.
+   * Let d be the size of the difference between the containers.
+   *
+   * Complexity: O(d * log(n/d)) expected time and memory.
+   **/
+  static delta between(const container_type& from, const container_type& to) {
+    return delta(to - from, from - to);
+  }
+
+  /**
+   * Returns the elements added by this delta.
+   **/
+  const container_type& added() const { return added_; }
+
+  /**
+   * Returns the elements removed by this delta.
+   **/
+  const container_type& removed() const { return removed_; }
+
+  /**
+   * Tests if this delta changes nothing.
+   **/
+  bool empty() const { return added_.empty() && removed_.empty(); }
+
+  /**
+   * Applies this delta to a container.
+   *
+   * Elements with the keys of removed() are erased and then the elements of
+   * added() are inserted, replacing any contained elements with the same
+   * keys.
+   *
+   * Result is undefined if not the container is using the same provider as
+   * this delta.
+   *
+   * @param container container to apply the delta to
+   * @return the container with the delta applied
+   *
+   * Let n be the size of the container.
+   * Let d be the size of this delta.
+   *
+   * Complexity: O(d * log(n/d)) expected time and memory.
+   **/
+  container_type apply(const container_type& container) const {
+    return added_ | erase_keys(container, removed_, category());
+  }
+
+  /**
+   * Returns a delta that is equivalent to applying this delta followed by
+   * another delta.
+   *
+   * Result is undefined if not both deltas are using the same provider.
+   *
+   * @param next delta to apply after this delta
+   * @return the composed delta
+   *
+   * Complexity: O(d * log(n/d)) expected time and memory, with d the size of
+   * the smaller delta and n the size of the larger delta.
+   *
+   * Note: The composed delta gives the same result as applying the deltas in
+   * order to any container, not only to the container this delta was computed
+   * from. Elements that are added by one delta and removed by the other
+   * therefore do not cancel out. Elements added by this delta and removed by
+   * the next are removed, and elements removed by this delta and added by the
+   * next are both removed and added. Keys removed by any of the deltas are
+   * removed by the composed delta.
+   **/
+  delta then(const delta& next) const {
+    return delta(next.added_ | erase_keys(added_, next.removed_, category()),
+                 removed_ | next.removed_);
+  }
+
+  /**
+   * Returns a delta that reverts this delta.
+   *
+   * The inverse restores a container that this delta was applied to if the
+   * delta was computed by between() from the same content. The inverse of a
+   * delta composed by then() also adds the elements that were added by the
+   * first delta and removed by the second.
+   *
+   * Complexity: Constant in time and memory.
+   **/
+  delta inverse() const { return delta(removed_, added_); }
+
+  /**
+   * Compares two deltas.
+   *
+   * Complexity: Constant in time.
+   **/
+  bool operator==(const delta& other) const {
+    return added_ == other.added_ && removed_ == other.removed_;
+  }
+
+  bool operator!=(const delta& other) const { return !(*this == other); }
+
+ private:
+  container_type added_;
+  container_type removed_;
+};
+
+/**
+ * Types of changes between two versions of a set or a map.
+ **/
+enum class change_type {
+  /**
+   * An element is contained in the new version only.
+   **/
+  added,
+
+  /**
+   * An element is contained in the old version only.
+   **/
+  removed,
+
+  /**
+   * Both versions contain elements with the same key but different mapped
+   * values. Only reported for maps.
+   **/
+  changed
+};
+
+/**
+ * A change between two versions of a set or a map.
+ **/
+template <class Traits>
+struct change {
+  typedef typename Traits::value_type value_type;
+
+  /**
+   * The type of the change.
+   **/
+  change_type type;
+
+  /**
+   * The element in the old version, or null if the element was added.
+   **/
+  const value_type* from;
+
+  /**
+   * The element in the new version, or null if the element was removed.
+   **/
+  const value_type* to;
+};
+
+/**
+ * An input iterator over the changes between two versions of a set or a map,
+ * in key order.
+ *
+ * The trees of the versions are traversed together, and subtrees that are
+ * shared by both versions are skipped without visiting their elements. No
+ * nodes are created.
+ *
+ * The iterator is invalidated if any of the two containers is destroyed or
+ * modified.
+ **/
+template <class Traits>
+class diff_iterator {
+  typedef internal::env<Traits> env_type;
+  typedef internal::node<Traits> node_type;
+  typedef typename internal::operation_cache<Traits>::ranker_type ranker_type;
+
+  // Remaining part of an in-order traversal. Entries are either whole
+  // subtrees or single nodes whose left subtrees have been visited.
+  typedef std::vector<std::pair<const node_type*, bool>> stack_type;
+
+ public:
+  typedef typename Traits::container container_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef const confluent::change<Traits> value_type;
+  typedef const value_type* pointer;
+  typedef const value_type& reference;
+  typedef std::input_iterator_tag iterator_category;
+
+  /**
+   * Creates an iterator past the last change.
+   **/
+  diff_iterator() : provider_(nullptr), ranker_(nullptr) {}
+
+  /**
+   * Creates an iterator to the first change from one container to another.
+   *
+   * Result is undefined if not both containers are using the same provider.
+   *
+   * @param from the old version
+   * @param to the new version
+   *
+   * Let n be the size of the larger container.
+   * Let d be the number of changes.
+   *
+   * Complexity: O(d * log(n/d)) expected time for the whole iteration and
+   * O(log n) expected memory.
+   **/
+  diff_iterator(const container_type& from, const container_type& to)
+      : provider_(from.provider().get()) {
+    assert(from.provider() == to.provider());
+    env_type env(provider_);
+    ranker_ = element_ranker(env);
+    push(&from_, internal::access::node(from).get());
+    push(&to_, internal::access::node(to).get());
+    next(env);
+  }
+
+  reference operator*() const { return change_; }
+  pointer operator->() const { return &change_; }
+
+  diff_iterator& operator++() {
+    next(env_type(provider_));
+    return *this;
+  }
+
+  diff_iterator operator++(int) {
+    diff_iterator it(*this);
+    ++*this;
+    return it;
+  }
+
+  bool operator==(const diff_iterator& other) const {
+    return done() == other.done() &&
+           (done() || (from_ == other.from_ && to_ == other.to_));
+  }
+
+  bool operator!=(const diff_iterator& other) const {
+    return !(*this == other);
+  }
+
+ private:
+  bool done() const { return !ranker_; }
+
+  static void push(stack_type* stack, const node_type* p) {
+    if (p)
+      stack->push_back({p, true});
+  }
+
+  // Replaces a subtree on the top of a stack with its root and its children.
+  static void expand(stack_type* stack) {
+    const node_type* p = stack->back().first;
+    stack->pop_back();
+    push(stack, p->right_.get());
+    stack->push_back({p, false});
+    push(stack, p->left_.get());
+  }
+
+  void emit(change_type type, const node_type* from, const node_type* to) {
+    change_.type = type;
+    change_.from = from ? &from->value() : nullptr;
+    change_.to = to ? &to->value() : nullptr;
+  }
+
+  void next(const env_type& env) {
+    while (true) {
+      if (from_.empty() && to_.empty()) {
+        ranker_ = nullptr;
+        return;
+      }
+      if (to_.empty()) {
+        if (from_.back().second) {
+          expand(&from_);
+          continue;
+        }
+        emit(change_type::removed, from_.back().first, nullptr);
+        from_.pop_back();
+        return;
+      }
+      if (from_.empty()) {
+        if (to_.back().second) {
+          expand(&to_);
+          continue;
+        }
+        emit(change_type::added, nullptr, to_.back().first);
+        to_.pop_back();
+        return;
+      }
+
+      const node_type* p = from_.back().first;
+      const node_type* q = to_.back().first;
+      if (from_.back().second && to_.back().second) {
+        // A subtree shared by both versions is skipped. Otherwise the larger
+        // subtree is expanded, since a shared subtree can only be found on its
+        // left spine.
+        if (p == q) {
+          from_.pop_back();
+          to_.pop_back();
+        } else if (internal::size(p) >= internal::size(q)) {
+          expand(&from_);
+        } else {
+          expand(&to_);
+        }
+        continue;
+      }
+      if (from_.back().second) {
+        expand(&from_);
+        continue;
+      }
+      if (to_.back().second) {
+        expand(&to_);
+        continue;
+      }
+
+      if (env.compare(p->key(), q->key())) {
+        emit(change_type::removed, p, nullptr);
+        from_.pop_back();
+        return;
+      }
+      if (env.compare(q->key(), p->key())) {
+        emit(change_type::added, nullptr, q);
+        to_.pop_back();
+        return;
+      }
+      from_.pop_back();
+      to_.pop_back();
+      if (ranker_(env, *p, *q) != internal::ranking::SAME) {
+        emit(change_type::changed, p, q);
+        return;
+      }
+    }
+  }
+
+  typename Traits::provider* provider_;
+  ranker_type ranker_;
+  stack_type from_;
+  stack_type to_;
+  confluent::change<Traits> change_;
+};
+
+/**
+ * The changes between two versions of a set or a map, as a range for
+ * range-based for loops.
+ **/
+template <class Traits>
+class diff_range {
+ public:
+  typedef typename Traits::container container_type;
+  typedef confluent::diff_iterator<Traits> iterator;
+
+  /**
+   * Creates a range of the changes from one container to another.
+   *
+   * The range holds copies of the containers, which are created in constant
+   * time, so that temporary containers can be passed. Iterators of the range
+   * are valid while the range exists.
+   **/
+  diff_range(const container_type& from, const container_type& to)
+      : from_(from), to_(to) {}
+
+  /**
+   * Returns an iterator to the first change.
+   **/
+  iterator begin() const { return iterator(from_, to_); }
+
+  /**
+   * Returns an iterator past the last change.
+   **/
+  iterator end() const { return iterator(); }
+
+ private:
+  const container_type from_;
+  const container_type to_;
+};
+
+/**
+ * Tag type of sorted_unique.
+ **/
+struct sorted_unique_t {
+  explicit sorted_unique_t() = default;
+};
+
+/**
+ * Tag that selects overloads of constructors and insert functions that require
+ * the input range to be sorted and to contain no equal keys.
+ *
+ * Such ranges are built into trees in linear time, creating each node once.
+ * Result is undefined if the range is not sorted or contains equal keys.
+ **/
+constexpr sorted_unique_t sorted_unique{};
+
+/**
+ * Modes of reclaiming the nodes of a provider that are no longer referenced.
+ **/
+enum class reclamation_mode {
+  /**
+   * Nodes are freed by the thread that drops their last references, when the
+   * references are dropped.
+   **/
+  immediate,
+
+  /**
+   * Unreferenced nodes are queued and freed in bounded slices by later node
+   * allocations of any thread using the provider, or by calls to reclaim().
+   **/
+  incremental,
+
+  /**
+   * Unreferenced nodes are queued and freed by a background thread owned by
+   * the provider.
+   **/
+  background
+};
+
+/**
+ * Options that control how a set_provider or a map_provider manages its nodes.
+ **/
+struct provider_options {
+  provider_options()
+      : concurrency(1),
+        reclamation(reclamation_mode::immediate),
+        reclamation_slice(1 << 5),
+        operation_cache_size(0) {}
+
+  /**
+   * The expected number of threads that concurrently create or destroy nodes
+   * using the provider.
+   *
+   * Nodes are kept in a table that is partitioned into independently locked
+   * segments, so that threads creating or destroying unrelated nodes rarely
+   * wait for each other. The number of segments is the given value rounded up
+   * to a power of two. The default value 1 uses a single lock.
+   **/
+  size_t concurrency;
+
+  /**
+   * How nodes that are no longer referenced are reclaimed.
+   *
+   * Dropping the last reference to a large tree, by destroying, clearing or
+   * reassigning a container, frees the nodes that are not shared with other
+   * containers. In the default immediate mode that work is done by the thread
+   * that drops the reference. The deferred modes instead queue the root of the
+   * tree, so that dropping it takes constant time, and free the nodes later.
+   * Queued nodes remain in the node table until freed and are shared again if
+   * structurally equal nodes are created before that.
+   **/
+  reclamation_mode reclamation;
+
+  /**
+   * The maximum number of queued nodes freed per node allocation in the
+   * incremental reclamation mode.
+   **/
+  size_t reclamation_slice;
+
+  /**
+   * The number of entries in the operation cache of the provider, or zero to
+   * disable the cache.
+   *
+   * The operation cache remembers results of set operations on pairs of
+   * subtrees. Since structurally equal subtrees share nodes, repeated or
+   * overlapping operations, such as repeated merges against a common ancestor,
+   * can then reuse results for whole subtrees. The cache is lossy: entries are
+   * replaced by later results that map to the same slot. Cached entries keep
+   * their input and result trees alive until replaced or until the cache is
+   * cleared.
+   **/
+  size_t operation_cache_size;
+};
+
+/**
+ * Snapshot of the statistics of a set_provider or a map_provider.
+ *
+ * Counters accumulate from the creation of the provider. Counters are read
+ * without locking and may be slightly out of date when other threads
+ * concurrently use the provider.
+ **/
+struct provider_statistics {
+  /**
+   * The number of nodes in the node table.
+   **/
+  size_t nodes;
+
+  /**
+   * The highest number of nodes that have been in the node table.
+   **/
+  size_t peak_nodes;
+
+  /**
+   * The number of created nodes, not counting created nodes that were
+   * discarded in favor of structurally equal nodes already in the table.
+   **/
+  size_t created_nodes;
+
+  /**
+   * The number of times a structurally equal node was found in the table and
+   * shared instead of creating a new node.
+   **/
+  size_t reused_nodes;
+
+  /**
+   * The number of nodes removed from the node table.
+   **/
+  size_t freed_nodes;
+
+  /**
+   * The number of times a segment of the node table was resized.
+   **/
+  size_t rehashes;
+
+  /**
+   * The number of times a thread had to wait for a segment of the node table
+   * that was locked by another thread.
+   **/
+  size_t contended_locks;
+
+  /**
+   * Total time spent waiting for segments locked by other threads.
+   **/
+  std::chrono::nanoseconds lock_wait;
+
+  /**
+   * The number of invocations of the comparison function that defines sort
+   * order.
+   **/
+  size_t comparisons;
+
+  /**
+   * The number of invocations of equality comparison functions.
+   **/
+  size_t equality_tests;
+
+  /**
+   * The number of invocations of hash functions.
+   **/
+  size_t hashes;
+
+  /**
+   * The number of results of set operations found in the operation cache.
+   **/
+  size_t cache_hits;
+
+  /**
+   * The number of lookups in the operation cache that did not find a result.
+   **/
+  size_t cache_misses;
+};
+
+/// @cond HIDDEN_SYMBOLS
+
+namespace internal {
+
+template <class Traits>
+provider_statistics make_statistics(
+    const node_table<Traits>& node_table,
+    const call_counters& call_counters,
+    const operation_cache<Traits>& operation_cache) {
+  typedef hash_table<Traits> segment;
+  typedef typename operation_cache<Traits>::segment cache_segment;
+  provider_statistics statistics;
+  statistics.nodes = node_table.size();
+  statistics.peak_nodes = node_table.peak_size_.load(std::memory_order_relaxed);
+  statistics.created_nodes = node_table.sum(&segment::created_);
+  statistics.reused_nodes = node_table.sum(&segment::reused_);
+  statistics.freed_nodes = node_table.sum(&segment::freed_);
+  statistics.rehashes = node_table.sum(&segment::rehashes_);
+  statistics.contended_locks = node_table.sum(&segment::contended_locks_);
+  statistics.lock_wait =
+      std::chrono::nanoseconds(node_table.sum(&segment::lock_wait_ns_));
+  statistics.comparisons =
+      call_counters.comparisons_.load(std::memory_order_relaxed);
+  statistics.equality_tests =
+      call_counters.equality_tests_.load(std::memory_order_relaxed);
+  statistics.hashes = call_counters.hashes_.load(std::memory_order_relaxed);
+  statistics.cache_hits = operation_cache.sum(&cache_segment::hits_);
+  statistics.cache_misses = operation_cache.sum(&cache_segment::misses_);
+  return statistics;
+}
+
+// Queue of nodes whose last references have been dropped, for providers that
+// defer reclamation. The queue holds the dropped references, so the nodes stay
+// in the node table and can be shared again until they are reclaimed.
+template <class Traits>
+struct reclaimer {
+  typedef typename Traits::provider provider_type;
+
+  explicit reclaimer(const provider_options& options)
+      : mode_(options.reclamation),
+        slice_(options.reclamation_slice),
+        pending_(0),
+        stopped_(false) {}
+
+  reclaimer(const reclaimer&) = delete;
+
+  ~reclaimer() { stop(); }
+
+  bool deferred() const { return mode_ != reclamation_mode::immediate; }
+
+  // Starts the background thread, if there should be one.
+  void start(provider_type* provider) {
+    if (mode_ == reclamation_mode::background)
+      thread_ = std::thread([this, provider] { run(provider); });
   }
 
-  void decrement() {
-    --pos_;
-    if (!decrementing_) {
-      stack_.clear();
-      decrementing_ = true;
-    }
-    if (stack_.empty()) {
-      size_t k = pos_;
-      node_ = container_->node_.get();
-      do {
-        while (k > size(node_->left_)) {
-          k -= size(node_->left_) + 1;
-          stack_.push_back(node_);
-          node_ = node_->right_.get();
-        }
-        while (k < size(node_->left_)) {
-          node_ = node_->left_.get();
-        }
-      } while (k != size(node_->left_));
-      return;
-    }
-    if (node_->left_) {
-      node_ = node_->left_.get();
-      while (node_->right_) {
-        stack_.push_back(node_);
-        node_ = node_->right_.get();
+  // Stops the background thread, if there is one.
+  void stop() {
+    if (thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
       }
-    } else {
-      node_ = stack_.back();
-      stack_.pop_back();
+      condition_.notify_one();
+      thread_.join();
     }
   }
 
-  void reset(size_t pos) {
-    if (pos == pos_ + 1 && pos != size(container_->node_)) {
-      increment();
-      return;
-    }
-    if (pos == pos_ - 1) {
-      decrement();
-      return;
-    }
-    if (pos_ != pos) {
-      pos_ = pos;
-      node_ = nullptr;
-      stack_.clear();
+  void defer(node<Traits>* p) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(p);
+      pending_.store(queue_.size(), std::memory_order_relaxed);
     }
+    if (mode_ == reclamation_mode::background)
+      condition_.notify_one();
   }
 
-  const node_type* find_node() const {
-    assert(pos_ < size(container_->node_));
-    if (!node_)
-      node_ = at_index(container_->node_.get(), pos_);
-    return node_;
+  // Reclaims a slice of the queue before a node is allocated.
+  void advance() {
+    if (mode_ == reclamation_mode::incremental &&
+        pending_.load(std::memory_order_relaxed))
+      reclaim(slice_);
   }
 
-  const container_type* container_;
-  size_t pos_;
-  mutable const node_type* node_;
-  std::vector<const node_type*> stack_;
-  bool decrementing_;
+  // Frees up to a given number of queued nodes, or until the queue is empty,
+  // and returns the number of freed nodes. Children of freed nodes are queued
+  // in place of their parents.
+  size_t reclaim(size_t max_count) {
+    release_batch<Traits> batch(env<Traits>::provider_);
+    size_t count = 0;
+    while (take(&batch.nodes_, max_count - count))
+      count += batch.step();
+    return count;
+  }
+
+  // Returns collected nodes to the queue and takes a chunk of up to a given
+  // number of nodes from it. Returns false if the taken chunk is empty.
+  bool take(std::vector<node<Traits>*>* nodes, size_t max_count) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.insert(queue_.end(), nodes->begin(), nodes->end());
+    size_t n = std::min(std::min(max_count, queue_.size()),
+                        size_t(release_batch<Traits>::max_chunk_size_));
+    nodes->assign(queue_.end() - n, queue_.end());
+    queue_.resize(queue_.size() - n);
+    pending_.store(queue_.size(), std::memory_order_relaxed);
+    return n != 0;
+  }
+
+  size_t pending() const { return pending_.load(std::memory_order_relaxed); }
+
+  void run(provider_type* provider) {
+    env<Traits> provider_env(provider);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopped_) {
+      if (queue_.empty()) {
+        condition_.wait(lock);
+      } else {
+        lock.unlock();
+        reclaim(release_batch<Traits>::max_chunk_size_);
+        lock.lock();
+      }
+    }
+  }
+
+  const reclamation_mode mode_;
+  const size_t slice_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::vector<node<Traits>*> queue_;
+  std::atomic<size_t> pending_;
+  bool stopped_;
+  std::thread thread_;
 };
 
-template <class Traits>
-std::ptrdiff_t distance(const iterator<Traits>& from,
-                        const iterator<Traits>& to) {
-  return to.pos_ - from.pos_;
-}
+}  // namespace internal
 
 /// @endcond HIDDEN_SYMBOLS
-
 /**
  * A set_provider provides resources such as nodes and functors to instances of
  * set and map.
@@ -1071,15 +3969,38 @@ class set_provider {
    * @param compare comparison function that defines sort order
    * @param hash hash function for computing hash values of elements
    * @param equal comparison function that tests if elements are equal
+   * @param options options that control how nodes are managed
    **/
   set_provider(const Compare& compare = Compare(),
                const Hash& hash = Hash(),
-               const Equal& equal = Equal())
-      : compare_(compare), hash_(hash), equal_(equal) {}
+               const Equal& equal = Equal(),
+               const provider_options& options = provider_options())
+      : compare_(compare),
+        hash_(hash),
+        equal_(equal),
+        options_(options),
+        node_table_(options.concurrency),
+        reclaimer_(options),
+        operation_cache_(options.operation_cache_size, options.concurrency) {
+    reclaimer_.start(this);
+  }
+
+  /**
+   * Constructs a new set_provider with default constructed functors.
+   *
+   * @param options options that control how nodes are managed
+   **/
+  explicit set_provider(const provider_options& options)
+      : set_provider(Compare(), Hash(), Equal(), options) {}
 
   set_provider(const set_provider&) = delete;
 
-  ~set_provider() { assert(size() == 0); }
+  ~set_provider() {
+    clear_operation_cache();
+    reclaimer_.stop();
+    reclaim();
+    assert(size() == 0);
+  }
 
   /**
    * Returns the comparison function that defines sort order.
@@ -1096,12 +4017,51 @@ class set_provider {
    **/
   const Equal& key_eq() const { return equal_; }
 
+  /**
+   * Returns the options this provider was created with.
+   **/
+  const provider_options& options() const { return options_; }
+
   /**
    * Returns the number of nodes allocated by this provider.
    **/
-  size_t size() const {
-    std::lock_guard<std::mutex> lock(hash_table_.mutex_);
-    return hash_table_.size_;
+  size_t size() const { return node_table_.size(); }
+
+  /**
+   * Returns the number of unreferenced nodes queued for reclamation. Freeing a
+   * queued node may queue its children in its place.
+   **/
+  size_t pending() const { return reclaimer_.pending(); }
+
+  /**
+   * Frees queued unreferenced nodes when reclamation is deferred.
+   *
+   * @param max_count maximum number of nodes to free
+   * @return number of freed nodes
+   **/
+  size_t reclaim(size_t max_count = std::numeric_limits<size_t>::max()) {
+    internal::env<traits> env(this);
+    return reclaimer_.reclaim(max_count);
+  }
+
+  /**
+   * Returns a snapshot of the statistics of this provider. Invocations of
+   * functors are counted per thread and included when the invoking operations
+   * have returned.
+   **/
+  provider_statistics statistics() const {
+    internal::env_base<traits>::flush_call_counts();
+    return internal::make_statistics(node_table_, call_counters_,
+                                      operation_cache_);
+  }
+
+  /**
+   * Removes all entries from the operation cache, releasing the nodes they
+   * keep alive.
+   **/
+  void clear_operation_cache() {
+    internal::env<traits> env(this);
+    operation_cache_.clear();
   }
 
   /**
@@ -1117,7 +4077,12 @@ class set_provider {
   const Compare compare_;
   const Hash hash_;
   const Equal equal_;
-  internal::hash_table<traits> hash_table_;
+  const provider_options options_;
+  internal::node_table<traits> node_table_;
+  internal::node_allocator<traits> node_allocator_;
+  internal::reclaimer<traits> reclaimer_;
+  internal::call_counters call_counters_;
+  internal::operation_cache<traits> operation_cache_;
 };
 
 /**
@@ -1147,6 +4112,7 @@ class set {
   typedef typename internal::node<traits> node_type;
 
   friend struct confluent::iterator<traits>;
+  friend struct internal::access;
 
  public:
   typedef T key_type;
@@ -1154,7 +4120,10 @@ class set {
   typedef set_provider<T, Compare, Hash, Equal> provider_type;
   typedef std::shared_ptr<provider_type> provider_ptr;
   typedef confluent::iterator<traits> iterator;
-  typedef std::reverse_iterator<iterator> reverse_iterator;
+  typedef confluent::reverse_iterator<traits> reverse_iterator;
+  typedef confluent::transient<traits> transient_type;
+  typedef confluent::expression<traits> expression_type;
+  typedef confluent::delta<traits> delta_type;
 
   /**
    * Creates a new set.
@@ -1184,6 +4153,26 @@ class set {
     insert(first, last);
   }
 
+  /**
+   * Creates a new set from a sorted range of unique elements.
+   *
+   * Result is undefined if the range is not sorted or contains equal elements.
+   *
+   * @param first range start
+   * @param last range end
+   * @param provider set_provider to use for this set (optional)
+   *
+   * Complexity: O(n) expected time and memory.
+   **/
+  template <class InputIterator>
+  set(sorted_unique_t,
+      InputIterator first,
+      InputIterator last,
+      provider_ptr provider = provider_type::default_provider())
+      : provider_(std::move(provider)) {
+    insert(sorted_unique, first, last);
+  }
+
   /**
    * Creates a new set from an initializer_list.
    *
@@ -1271,6 +4260,25 @@ class set {
     return internal::insert(env(), &node_, first, last);
   }
 
+  /**
+   * Inserts a sorted range of unique elements into this set.
+   *
+   * New element are inserted if they are not contained before.
+   *
+   * Result is undefined if the range is not sorted or contains equal elements.
+   *
+   * @param first range start
+   * @param last range end
+   * @return the number of inserted elements
+   *
+   * Complexity: Same cost as first creating a set from the given range in
+   *     O(n) and then inserting the created set into this set.
+   **/
+  template <class InputIterator>
+  size_t insert(sorted_unique_t, InputIterator first, InputIterator last) {
+    return internal::insert_sorted(env(), &node_, first, last);
+  }
+
   /**
    * Inserts elements from an initializer_list into this set.
    *
@@ -1801,9 +4809,10 @@ class set {
    * Let m be the size of the other.
    * Let d be the size of the difference between this set and the other set.
    *
-   * Complexity: O(min(m * log(n/m), d * log(n/d))) expected time and memory.
+   * Complexity: O(min(m * log(n/m), d * log(n/d))) expected time and
+   * O(log n) expected memory.
    *
-   * Note: The operation will return directly if m > n.
+   * Note: The operation will return directly if m > n. No nodes are created.
    **/
   bool includes(const set& other) const {
     check(other);
@@ -1811,6 +4820,101 @@ class set {
                               other.node_);
   }
 
+  /**
+   * Tests if this set and another set have any element in common.
+   *
+   * Result is undefined if not both sets are using the same set_provider.
+   *
+   * @param other set to test
+   * @return true if an element is contained in both sets, false otherwise
+   *
+   * Let n be the size of the larger set.
+   * Let m be the size of the smaller set.
+   * Let d be the size of the difference between this set and the other set.
+   *
+   * Complexity: O(min(m * log(n/m), d * log(n/d))) expected time and
+   * O(log n) expected memory.
+   *
+   * Note: The operation returns when the first common element is found. No
+   * nodes are created.
+   **/
+  bool intersects(const set& other) const {
+    check(other);
+    return internal::intersects(env(), &internal::rank<traits>, node_,
+                                other.node_);
+  }
+
+  /**
+   * Tests if this set and another set have no element in common.
+   *
+   * disjoint(other);
+   *
+   * is equivalent to
+   *
+   * !intersects(other);
+   **/
+  bool disjoint(const set& other) const { return !intersects(other); }
+
+  /**
+   * Returns a transient with the content of this set, for applying a batch of
+   * updates that are shared in a single pass when done.
+   *
+   * set::transient_type t = s.transient();
+   * t.insert(k1);
+   * t.erase(k2);
+   * s = t.persistent();
+   *
+   * Complexity: Constant in time and memory.
+   **/
+  transient_type transient() const { return transient_type(*this); }
+
+  /**
+   * Returns an expression with this set as its only operand, for combining
+   * several sets in a single pass when the expression is evaluated.
+   *
+   * set r = s.lazy() | x | y;
+   *
+   * Complexity: Constant in time and memory.
+   **/
+  expression_type lazy() const { return expression_type(*this); }
+
+  /**
+   * Returns the delta that changes this set into another set.
+   *
+   * Result is undefined if not both sets are using the same set_provider.
+   *
+   * @param to the new version
+   * @return a delta with the elements added and removed by the change
+   *
+   * Let n be the size of the larger set.
+   * Let d be the size of the difference between the sets.
+   *
+   * Complexity: O(d * log(n/d)) expected time and memory.
+   **/
+  delta_type delta(const set& to) const {
+    check(to);
+    return delta_type::between(*this, to);
+  }
+
+  /**
+   * Applies a delta to this set.
+   *
+   * Result is undefined if not the delta is using the same set_provider as
+   * this set.
+   *
+   * @param delta delta to apply
+   * @return a reference to this set after it has been updated
+   *
+   * Let n be the size of this set.
+   * Let d be the size of the delta.
+   *
+   * Complexity: O(d * log(n/d)) expected time and memory.
+   **/
+  set& apply(const delta_type& delta) {
+    *this = delta.apply(*this);
+    return *this;
+  }
+
   /**
    * Returns a shared pointer to the set_provider used by this set.
    **/
@@ -1923,6 +5027,238 @@ size_t hash(const set<T, Compare, Hash, Equal>& x) {
   return x.hash();
 }
 
+/**
+ * Returns the union of a range of sets, or of a range of maps, merged in a
+ * single pass over all of them.
+ *
+ * Elements of maps are unique with respect to keys, with precedence for
+ * elements from containers earlier in the range.
+ *
+ * Result is undefined if not all containers are using the same provider.
+ *
+ * @param first iterator to the first container
+ * @param last iterator past the last container
+ * @return a container with all elements in the containers, or an empty
+ *     container if the range is empty
+ *
+ * Let k be the number of containers.
+ * Let n be the size of the result.
+ *
+ * Complexity: O(k + n * log n) expected time in the worst case and
+ * O(n) expected memory, and less when the containers share subtrees.
+ **/
+template <class ForwardIterator>
+typename std::iterator_traits<ForwardIterator>::value_type union_all(
+    ForwardIterator first,
+    ForwardIterator last) {
+  typedef typename std::iterator_traits<ForwardIterator>::value_type
+      container_type;
+  typedef typename internal::access::traits<container_type>::type traits;
+  if (first == last)
+    return container_type();
+  typename container_type::provider_ptr provider = first->provider();
+  internal::env<traits> env(provider.get());
+  internal::multiway_merge<traits> merge(env);
+  for (; first != last; ++first) {
+    assert(first->provider() == provider);
+    merge.push(internal::access::node(*first));
+  }
+  return internal::access::make<container_type>(provider, merge.set_union());
+}
+
+/**
+ * Returns the union of a range of sets, or of a range of maps.
+ *
+ * union_all(range);
+ *
+ * is equivalent to
+ *
+ * union_all(std::begin(range), std::end(range));
+ **/
+template <class Range>
+auto union_all(const Range& range)
+    -> decltype(union_all(std::begin(range), std::end(range))) {
+  return union_all(std::begin(range), std::end(range));
+}
+
+/**
+ * Returns the union of a list of sets, or of a list of maps.
+ **/
+template <class Container>
+Container union_all(std::initializer_list<Container> ilist) {
+  return union_all(ilist.begin(), ilist.end());
+}
+
+/**
+ * Returns the intersection of a range of sets, or of a range of maps, merged
+ * in a single pass over all of them.
+ *
+ * Elements of maps are matched by keys only, and the elements of the result
+ * are taken from the first container.
+ *
+ * The pass is driven by the smallest subtree at each step and stops
+ * descending as soon as one of the containers has no keys left in a subtree.
+ *
+ * Result is undefined if not all containers are using the same provider.
+ *
+ * @param first iterator to the first container
+ * @param last iterator past the last container
+ * @return a container with the elements that are in all containers, or an
+ *     empty container if the range is empty
+ *
+ * Let k be the number of containers.
+ * Let m be the size of the smallest container.
+ * Let n be the size of the largest container.
+ *
+ * Complexity: O(k * m * log n) expected time in the worst case and O(m)
+ * expected memory, and less when the containers share subtrees.
+ **/
+template <class ForwardIterator>
+typename std::iterator_traits<ForwardIterator>::value_type intersect_all(
+    ForwardIterator first,
+    ForwardIterator last) {
+  typedef typename std::iterator_traits<ForwardIterator>::value_type
+      container_type;
+  typedef typename internal::access::traits<container_type>::type traits;
+  if (first == last)
+    return container_type();
+  typename container_type::provider_ptr provider = first->provider();
+  internal::env<traits> env(provider.get());
+  internal::multiway_merge<traits> merge(env);
+  for (; first != last; ++first) {
+    assert(first->provider() == provider);
+    merge.push(internal::access::node(*first));
+  }
+  return internal::access::make<container_type>(provider,
+                                                merge.set_intersection());
+}
+
+/**
+ * Returns the intersection of a range of sets, or of a range of maps.
+ *
+ * intersect_all(range);
+ *
+ * is equivalent to
+ *
+ * intersect_all(std::begin(range), std::end(range));
+ **/
+template <class Range>
+auto intersect_all(const Range& range)
+    -> decltype(intersect_all(std::begin(range), std::end(range))) {
+  return intersect_all(std::begin(range), std::end(range));
+}
+
+/**
+ * Returns the intersection of a list of sets, or of a list of maps.
+ **/
+template <class Container>
+Container intersect_all(std::initializer_list<Container> ilist) {
+  return intersect_all(ilist.begin(), ilist.end());
+}
+
+/**
+ * Returns the size of the intersection of two sets, without creating it.
+ *
+ * Result is undefined if not both sets are using the same set_provider.
+ *
+ * Let n be the size of the larger set.
+ * Let m be the size of the smaller set.
+ * Let d be the size of the difference between the sets.
+ *
+ * Complexity: O(min(m * log(n/m), d * log(n/d))) expected time and
+ * O(log n) expected memory.
+ **/
+template <class T, class Compare, class Hash, class Equal>
+size_t intersection_size(const set<T, Compare, Hash, Equal>& lhs,
+                         const set<T, Compare, Hash, Equal>& rhs) {
+  typedef internal::set_traits<T, Compare, Hash, Equal> traits;
+  assert(lhs.provider() == rhs.provider());
+  internal::env<traits> env(lhs.provider().get());
+  return internal::intersection_size(env, &internal::rank<traits>,
+                                     internal::access::node(lhs),
+                                     internal::access::node(rhs));
+}
+
+/**
+ * Returns the size of the difference of two sets, without creating it.
+ *
+ * Result is undefined if not both sets are using the same set_provider.
+ *
+ * Complexity: Same as intersection_size(lhs, rhs).
+ **/
+template <class T, class Compare, class Hash, class Equal>
+size_t difference_size(const set<T, Compare, Hash, Equal>& lhs,
+                       const set<T, Compare, Hash, Equal>& rhs) {
+  return lhs.size() - intersection_size(lhs, rhs);
+}
+
+/**
+ * Returns the size of the union of two sets, without creating it.
+ *
+ * Result is undefined if not both sets are using the same set_provider.
+ *
+ * Complexity: Same as intersection_size(lhs, rhs).
+ **/
+template <class T, class Compare, class Hash, class Equal>
+size_t union_size(const set<T, Compare, Hash, Equal>& lhs,
+                  const set<T, Compare, Hash, Equal>& rhs) {
+  return lhs.size() + rhs.size() - intersection_size(lhs, rhs);
+}
+
+/**
+ * Returns the size of the symmetric difference of two sets, without creating
+ * it.
+ *
+ * Result is undefined if not both sets are using the same set_provider.
+ *
+ * Complexity: Same as intersection_size(lhs, rhs).
+ **/
+template <class T, class Compare, class Hash, class Equal>
+size_t symmetric_difference_size(const set<T, Compare, Hash, Equal>& lhs,
+                                 const set<T, Compare, Hash, Equal>& rhs) {
+  return lhs.size() + rhs.size() - 2 * intersection_size(lhs, rhs);
+}
+
+/**
+ * Returns the changes from one set to another, in key order.
+ *
+ * for (const auto& c : diff(old_version, new_version)) { ... }
+ *
+ * Result is undefined if not both sets are using the same set_provider.
+ *
+ * @param from the old version
+ * @param to the new version
+ * @return a range of changes
+ *
+ * Let n be the size of the larger set.
+ * Let d be the size of the difference between the sets.
+ *
+ * Complexity: O(d * log(n/d)) expected time for the whole iteration and
+ * O(log n) expected memory.
+ **/
+template <class T, class Compare, class Hash, class Equal>
+diff_range<internal::set_traits<T, Compare, Hash, Equal>> diff(
+    const set<T, Compare, Hash, Equal>& from,
+    const set<T, Compare, Hash, Equal>& to) {
+  return {from, to};
+}
+
+/**
+ * Returns the Jaccard index of two sets, the size of their intersection
+ * divided by the size of their union, or 1 if both sets are empty.
+ *
+ * Result is undefined if not both sets are using the same set_provider.
+ *
+ * Complexity: Same as intersection_size(lhs, rhs).
+ **/
+template <class T, class Compare, class Hash, class Equal>
+double jaccard(const set<T, Compare, Hash, Equal>& lhs,
+               const set<T, Compare, Hash, Equal>& rhs) {
+  size_t n = intersection_size(lhs, rhs);
+  size_t d = lhs.size() + rhs.size() - n;
+  return d == 0 ? 1.0 : double(n) / double(d);
+}
+
 }  // namespace confluent
 
 #endif  // CONFLUENT_SET_H_INCLUDED
@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) 2017 Olle Liljenzin
+ */
+
+#ifndef CONFLUENT_SNAPSHOT_H_INCLUDED
+#define CONFLUENT_SNAPSHOT_H_INCLUDED
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include "map.h"
+#include "set.h"
+
+namespace confluent {
+
+/// @cond HIDDEN_SYMBOLS
+
+namespace internal {
+
+// Tests if values of a type can be stored in a snapshot and used in place.
+template <class T>
+struct is_snapshot_value : std::is_trivially_copyable<T> {};
+
+template <class First, class Second>
+struct is_snapshot_value<std::pair<First, Second>>
+    : std::integral_constant<bool,
+                             is_snapshot_value<First>::value &&
+                                 is_snapshot_value<Second>::value> {};
+
+// A snapshot file starts with a header, followed by the values of the
+// container in sorted order and then by one node entry per value. Nodes are
+// identified by the positions of their values, starting from 1, and 0
+// identifies the empty tree.
+struct snapshot_header {
+  char magic_[8];
+  std::uint64_t value_size_;
+  std::uint64_t size_;
+  std::uint64_t root_;
+  std::uint64_t hash_;
+  std::uint64_t values_offset_;
+  std::uint64_t nodes_offset_;
+  std::uint64_t file_size_;
+};
+
+struct snapshot_node {
+  std::uint64_t left_;
+  std::uint64_t right_;
+  std::uint64_t size_;
+  std::uint64_t hash_;
+  std::uint64_t priority_;
+};
+
+constexpr char snapshot_magic[8] = {'C', 'F', 'S', 'N', 'A', 'P', '1', '\0'};
+
+inline std::uint64_t snapshot_align(std::uint64_t offset, std::uint64_t a) {
+  return (offset + a - 1) / a * a;
+}
+
+template <class Value>
+snapshot_header make_snapshot_header(std::uint64_t size,
+                                     std::uint64_t root,
+                                     std::uint64_t hash) {
+  const std::uint64_t a = std::max<std::uint64_t>(alignof(Value), 8);
+  snapshot_header header;
+  std::memcpy(header.magic_, snapshot_magic, sizeof(header.magic_));
+  header.value_size_ = sizeof(Value);
+  header.size_ = size;
+  header.root_ = root;
+  header.hash_ = hash;
+  header.values_offset_ = snapshot_align(sizeof(snapshot_header), a);
+  header.nodes_offset_ =
+      snapshot_align(header.values_offset_ + size * sizeof(Value), 8);
+  header.file_size_ = header.nodes_offset_ + size * sizeof(snapshot_node);
+  return header;
+}
+
+template <class Stream>
+void write_snapshot_padding(Stream& stream, std::uint64_t n) {
+  const char zeros[64] = {};
+  for (; n > sizeof(zeros); n -= sizeof(zeros))
+    stream.write(zeros, sizeof(zeros));
+  stream.write(zeros, n);
+}
+
+template <class Traits, class Stream>
+void write_snapshot_values(Stream& stream, const node_ptr<Traits>& p) {
+  if (p) {
+    write_snapshot_values(stream, p->left_);
+    stream.write(reinterpret_cast<const char*>(&p->value()),
+                 sizeof(p->value()));
+    write_snapshot_values(stream, p->right_);
+  }
+}
+
+// Writes the node entries of a subtree whose values are preceded by offset
+// values in the sorted order.
+template <class Traits, class Stream>
+void write_snapshot_nodes(Stream& stream,
+                          const node_ptr<Traits>& p,
+                          std::uint64_t offset) {
+  if (p) {
+    std::uint64_t id = offset + size(p->left_) + 1;
+    write_snapshot_nodes(stream, p->left_, offset);
+    snapshot_node n = {p->left_ ? offset + size(p->left_->left_) + 1 : 0,
+                       p->right_ ? id + size(p->right_->left_) + 1 : 0,
+                       p->size(), p->hash_, p->priority()};
+    stream.write(reinterpret_cast<const char*>(&n), sizeof(n));
+    write_snapshot_nodes(stream, p->right_, id);
+  }
+}
+
+}  // namespace internal
+
+/// @endcond
+
+/**
+ * A read-only set or map that is used in place from a memory region holding
+ * a snapshot file, typically a file mapped into memory.
+ *
+ * Snapshot files are written by write_snapshot() and hold the values of a
+ * container in sorted order, followed by the tree structure of the container
+ * with the size, hash and priority of every node. Opening a snapshot only
+ * validates the header, after which lookups, indexed access and iteration
+ * read the values directly from the region. Values must be trivially
+ * copyable, or pairs of such values, and are stored with the data layout of
+ * the writing process.
+ *
+ * A snapshot is converted to a container with container(), which is needed to
+ * derive new versions with set operations. Nodes are rebuilt from the stored
+ * tree structure without comparing or sorting elements, and nodes equal to
+ * nodes already in the provider are shared with them.
+ *
+ * Snapshots are cheap to copy and share the mapping of the file.
+ *
+ * @tparam Container type of the container stored in the snapshot
+ **/
+template <class Container>
+class snapshot {
+  typedef typename internal::access::traits<Container>::type traits;
+  typedef internal::node_ptr<traits> node_ptr;
+
+ public:
+  typedef typename Container::key_type key_type;
+  typedef typename Container::value_type value_type;
+  typedef typename Container::provider_type provider_type;
+  typedef typename Container::provider_ptr provider_ptr;
+  typedef const value_type* iterator;
+  typedef std::reverse_iterator<iterator> reverse_iterator;
+
+  static_assert(internal::is_snapshot_value<value_type>::value,
+                "snapshot values must be trivially copyable");
+
+  /**
+   * Constructs a snapshot from a memory region holding a snapshot file.
+   *
+   * The region must be aligned as the values and remain valid as long as the
+   * snapshot or any copy of it is used.
+   *
+   * @param data start of the region
+   * @param size size of the region in bytes
+   * @param provider provider used for comparisons and by container()
+   * @throw std::runtime_error if the region does not hold a snapshot of the
+   *   value type
+   *
+   * Complexity: Constant.
+   **/
+  snapshot(const void* data,
+           size_t size,
+           provider_ptr provider = provider_type::default_provider())
+      : snapshot(std::shared_ptr<const void>(data, [](const void*) {}),
+                 size,
+                 std::move(provider)) {}
+
+  /**
+   * Maps a snapshot file into memory and constructs a snapshot from it.
+   *
+   * @param path path of the file
+   * @param provider provider used for comparisons and by container()
+   * @return a snapshot of the file
+   * @throw std::runtime_error if the file cannot be mapped or does not hold a
+   *   snapshot of the value type
+   *
+   * Complexity: Constant. Pages are read from the file when first accessed.
+   **/
+  static snapshot open(
+      const std::string& path,
+      provider_ptr provider = provider_type::default_provider()) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("cannot open " + path);
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0)
+      data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+      throw std::runtime_error("cannot map " + path);
+    size_t size = st.st_size;
+    return snapshot(std::shared_ptr<const void>(
+                        data, [size](const void* p) {
+                          ::munmap(const_cast<void*>(p), size);
+                        }),
+                    size, std::move(provider));
+  }
+
+  /**
+   * Returns an iterator to the beginning of this snapshot.
+   **/
+  iterator begin() const { return values_; }
+
+  /**
+   * Returns an iterator to the end of this snapshot.
+   **/
+  iterator end() const { return values_ + size(); }
+
+  /**
+   * Returns a reverse iterator to the beginning of this snapshot.
+   **/
+  reverse_iterator rbegin() const { return reverse_iterator(end()); }
+
+  /**
+   * Returns a reverse iterator to the end of this snapshot.
+   **/
+  reverse_iterator rend() const { return reverse_iterator(begin()); }
+
+  /**
+   * Returns the number of elements in this snapshot.
+   **/
+  size_t size() const { return header_->size_; }
+
+  /**
+   * Tests if this snapshot is empty.
+   **/
+  bool empty() const { return size() == 0; }
+
+  /**
+   * Returns the hash value of the container stored in this snapshot, which
+   * is equal to the hash value returned by container().
+   **/
+  size_t hash() const { return header_->hash_; }
+
+  /**
+   * Finds an element with a given key.
+   *
+   * @param key key to search for
+   * @return an iterator to the found element or end of this snapshot if not
+   *   found
+   *
+   * Complexity: O(log n).
+   **/
+  iterator find(const key_type& key) const {
+    internal::env<traits> env(provider_.get());
+    iterator it = lower_bound(env, key);
+    return it != end() && env.equal(key_of(env, *it), key) ? it : end();
+  }
+
+  /**
+   * Returns an iterator to the first element not less than a given key.
+   *
+   * @param key key to search for
+   * @return an iterator to the first element not less than the given key.
+   *
+   * Complexity: O(log n).
+   **/
+  iterator lower_bound(const key_type& key) const {
+    internal::env<traits> env(provider_.get());
+    return lower_bound(env, key);
+  }
+
+  /**
+   * Returns an iterator to the first element greater than a given key.
+   *
+   * @param key key to search for
+   * @return an iterator to the first element greater than the given key.
+   *
+   * Complexity: O(log n).
+   **/
+  iterator upper_bound(const key_type& key) const {
+    internal::env<traits> env(provider_.get());
+    return std::upper_bound(begin(), end(), key,
+                            [&](const key_type& k, const value_type& value) {
+                              return env.compare(k, key_of(env, value));
+                            });
+  }
+
+  /**
+   * Returns the number of elements matching a given key.
+   *
+   * @param key key to search for
+   * @return 1 if an element was found, otherwise 0
+   *
+   * Complexity: O(log n).
+   **/
+  size_t count(const key_type& key) const { return find(key) != end(); }
+
+  /**
+   * Finds an element at a given index.
+   *
+   * @param k the index of the wanted element
+   * @return a reference to the element at the given index
+   *
+   * Complexity: Constant.
+   **/
+  const value_type& at_index(size_t k) const { return values_[k]; }
+
+  /**
+   * Converts this snapshot to a container.
+   *
+   * @return a container with the elements of this snapshot
+   * @throw std::runtime_error if the stored tree structure is not valid or was
+   *   written with another hash functor
+   *
+   * Complexity: O(n) expected time.
+   **/
+  Container container() const {
+    internal::env<traits> env(provider_.get());
+    node_ptr root = make_tree(env, header_->root_, 0, size() + 1);
+    if (internal::size(root) != size())
+      throw std::runtime_error("corrupt confluent snapshot");
+    if (internal::hash(root) != header_->hash_)
+      throw std::runtime_error("snapshot written with another hash functor");
+    return internal::access::make<Container>(provider_, std::move(root));
+  }
+
+  /**
+   * Returns the provider of this snapshot.
+   **/
+  const provider_ptr& provider() const { return provider_; }
+
+ private:
+  snapshot(std::shared_ptr<const void> data, size_t size, provider_ptr provider)
+      : data_(std::move(data)), provider_(std::move(provider)) {
+    const char* bytes = static_cast<const char*>(data_.get());
+    header_ = reinterpret_cast<const internal::snapshot_header*>(bytes);
+    if (size < sizeof(internal::snapshot_header) ||
+        std::memcmp(header_->magic_, internal::snapshot_magic,
+                    sizeof(header_->magic_)) != 0)
+      throw std::runtime_error("not a confluent snapshot");
+    internal::snapshot_header expected =
+        internal::make_snapshot_header<value_type>(
+            header_->size_, header_->root_, header_->hash_);
+    if (header_->value_size_ != expected.value_size_ ||
+        header_->values_offset_ != expected.values_offset_ ||
+        header_->nodes_offset_ != expected.nodes_offset_ ||
+        header_->file_size_ != expected.file_size_ ||
+        header_->file_size_ > size || header_->root_ > header_->size_ ||
+        (header_->root_ == 0) != (header_->size_ == 0))
+      throw std::runtime_error("corrupt confluent snapshot");
+    values_ = reinterpret_cast<const value_type*>(bytes +
+                                                  header_->values_offset_);
+    nodes_ = reinterpret_cast<const internal::snapshot_node*>(
+        bytes + header_->nodes_offset_);
+  }
+
+  iterator lower_bound(const internal::env<traits>& env,
+                       const key_type& key) const {
+    return std::lower_bound(begin(), end(), key,
+                            [&](const value_type& value, const key_type& k) {
+                              return env.compare(key_of(env, value), k);
+                            });
+  }
+
+  // Rebuilds the subtree with a given id, which must be within the exclusive
+  // bounds lo and hi given by the ancestors of the node. Each child narrows
+  // the bounds of its subtree to one side of its parent, so corrupt entries
+  // cannot create cycles or visit a node twice. Each child must also rank
+  // below its parent, so that the rebuilt tree is the canonical treap.
+  node_ptr make_tree(const internal::env<traits>& env,
+                     std::uint64_t id,
+                     std::uint64_t lo,
+                     std::uint64_t hi) const {
+    if (!id)
+      return nullptr;
+    if (id <= lo || id >= hi)
+      throw std::runtime_error("corrupt confluent snapshot");
+    const internal::snapshot_node& n = nodes_[id - 1];
+    node_ptr p =
+        make_node(env, values_[id - 1], make_tree(env, n.left_, lo, id),
+                  make_tree(env, n.right_, id, hi));
+    if (p->priority() != n.priority_ || p->size() != n.size_)
+      throw std::runtime_error("snapshot written with another hash functor");
+    if ((p->left_ && rank(env, *p, *p->left_) != internal::ranking::LEFT) ||
+        (p->right_ && rank(env, *p, *p->right_) != internal::ranking::LEFT))
+      throw std::runtime_error("corrupt confluent snapshot");
+    return p;
+  }
+
+  std::shared_ptr<const void> data_;
+  provider_ptr provider_;
+  const internal::snapshot_header* header_;
+  const value_type* values_;
+  const internal::snapshot_node* nodes_;
+};
+
+/**
+ * Writes a snapshot of a container to a stream, to be used in place by the
+ * snapshot class.
+ *
+ * The stream is any object with the member:
+ *
+ * void write(const char* s, size_t n);  // writes n bytes
+ *
+ * which includes std::ostream.
+ *
+ * @param stream stream to write to
+ * @param container the container to write
+ *
+ * Complexity: O(n) time and O(log n) expected memory.
+ **/
+template <class Stream, class Container>
+void write_snapshot(Stream& stream, const Container& container) {
+  typedef typename Container::value_type value_type;
+  static_assert(internal::is_snapshot_value<value_type>::value,
+                "snapshot values must be trivially copyable");
+  const auto& root = internal::access::node(container);
+  internal::snapshot_header header =
+      internal::make_snapshot_header<value_type>(
+          container.size(), root ? internal::size(root->left_) + 1 : 0,
+          container.hash());
+  stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  internal::write_snapshot_padding(stream,
+                                   header.values_offset_ - sizeof(header));
+  internal::write_snapshot_values(stream, root);
+  internal::write_snapshot_padding(
+      stream, header.nodes_offset_ - header.values_offset_ -
+                  header.size_ * sizeof(value_type));
+  internal::write_snapshot_nodes(stream, root, 0);
+}
+
+}  // namespace confluent
+
+#endif  // CONFLUENT_SNAPSHOT_H_INCLUDED
@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2017 Olle Liljenzin
+ */
+
+#ifndef CONFLUENT_SYNC_H_INCLUDED
+#define CONFLUENT_SYNC_H_INCLUDED
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "map.h"
+#include "serialize.h"
+#include "set.h"
+
+namespace confluent {
+
+/// @cond HIDDEN_SYMBOLS
+
+namespace internal {
+
+struct fingerprint {
+  std::uint64_t high_;
+  std::uint64_t low_;
+};
+
+inline bool operator==(const fingerprint& lhs, const fingerprint& rhs) {
+  return lhs.high_ == rhs.high_ && lhs.low_ == rhs.low_;
+}
+
+inline bool operator!=(const fingerprint& lhs, const fingerprint& rhs) {
+  return !(lhs == rhs);
+}
+
+inline std::uint64_t mix64(std::uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+// Digests a byte stream into a 128-bit fingerprint. The halves are computed by
+// two independent multiplicative hashes that are mixed together when the
+// digest is taken. The builder is a stream, so values are digested by writing
+// them with their codec.
+class fingerprint_builder {
+ public:
+  fingerprint_builder()
+      : high_(0xcbf29ce484222325), low_(0x9e3779b97f4a7c15), length_(0) {}
+
+  void write(const char* s, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      std::uint64_t c = static_cast<unsigned char>(s[i]);
+      high_ = (high_ ^ c) * 0x100000001b3;
+      low_ = (low_ ^ c) * 0xff51afd7ed558ccd;
+      low_ ^= low_ >> 32;
+    }
+    length_ += n;
+  }
+
+  void write(const fingerprint& f) {
+    write_uint64(*this, f.high_);
+    write_uint64(*this, f.low_);
+  }
+
+  fingerprint digest() const {
+    std::uint64_t high = mix64(high_ ^ length_);
+    std::uint64_t low = mix64(low_ + high);
+    return {high, low};
+  }
+
+ private:
+  std::uint64_t high_;
+  std::uint64_t low_;
+  std::uint64_t length_;
+};
+
+// Strong fingerprints of subtrees, computed from the encoded elements and the
+// fingerprints of the children. Entries keep their nodes alive so that node
+// addresses are not reused while cached, and must be cleared with an env.
+// Fingerprints found in an optional base cache are not added, so that a
+// scratch cache layered on a long-lived cache holds only the nodes that are
+// missing in the base.
+template <class Traits, class Codec>
+class fingerprint_cache {
+ public:
+  explicit fingerprint_cache(const fingerprint_cache* base = nullptr)
+      : base_(base) {}
+
+  fingerprint get(const node_ptr<Traits>& p) {
+    if (!p)
+      return {0, 0};
+    auto it = entries_.find(p.get());
+    if (it != entries_.end())
+      return it->second.second;
+    if (base_) {
+      auto base_it = base_->entries_.find(p.get());
+      if (base_it != base_->entries_.end())
+        return base_it->second.second;
+    }
+    fingerprint_builder builder;
+    Codec::write(builder, p->value());
+    builder.write(get(p->left_));
+    builder.write(get(p->right_));
+    fingerprint f = builder.digest();
+    entries_.emplace(p.get(), std::make_pair(p, f));
+    return f;
+  }
+
+  void clear() { entries_.clear(); }
+
+ private:
+  const fingerprint_cache* const base_;
+  std::unordered_map<const node<Traits>*,
+                     std::pair<node_ptr<Traits>, fingerprint>>
+      entries_;
+};
+
+}  // namespace internal
+
+/// @endcond
+
+/**
+ * Digests that are compared to find equal subtrees when containers are
+ * synchronized.
+ **/
+enum class fingerprint_mode {
+  /**
+   * The 64-bit structural hashes kept in every node are compared. No extra
+   * work is needed to digest a subtree, but subtrees that differ are taken for
+   * equal if their hashes collide, leaving the replica different from the
+   * source.
+   **/
+  hash,
+
+  /**
+   * 128-bit fingerprints computed from the encoded elements are compared.
+   * Fingerprints of the nodes of served and pulled containers are cached by
+   * the synchronizer until it is cleared, so the first synchronization encodes
+   * every element once and later synchronizations of versions sharing nodes
+   * only encode the new nodes. Fingerprints of the nodes that pull() creates
+   * to cut out key ranges of the replica are dropped when it returns.
+   * Accidental collisions are negligible, but the fingerprints are not
+   * cryptographic and do not protect against a peer crafting colliding values.
+   **/
+  strong
+};
+
+/**
+ * Options that control how a synchronizer exchanges digests.
+ **/
+struct sync_options {
+  sync_options() : fingerprint(fingerprint_mode::hash), leaf_size(8) {}
+
+  /**
+   * How subtrees are digested. Both ends must use the same mode.
+   **/
+  fingerprint_mode fingerprint;
+
+  /**
+   * Differing subtrees of the source with at most this many elements are
+   * transferred as a whole instead of being compared further. Only used by
+   * the replica.
+   **/
+  size_t leaf_size;
+};
+
+/**
+ * Synchronizes a replica of a set or a map with a source container held by
+ * another process, by transferring only the elements that differ.
+ *
+ * One end calls serve() with the source container and the other end calls
+ * pull() with its replica, each with a stream connected to the other end. The
+ * replica is typically an older version of the source, e.g. a copy that
+ * missed updates during a network partition.
+ *
+ * The two ends walk the tree of the source top-down. Each round the source
+ * sends the size and digest of a frontier of its subtrees, and the replica
+ * compares them with the elements it holds within the same key ranges. Equal
+ * ranges are kept from the replica, small differing subtrees are transferred
+ * as a whole, and larger ones are split at their root element, whose value is
+ * transferred, into the two ranges of the next frontier. Subtrees of the
+ * replica within a key range are cut out with O(log n) new nodes and compared
+ * in constant time, or in time proportional to the new nodes in strong
+ * fingerprint mode.
+ *
+ * A tree depends only on the elements and the hash functor of the container,
+ * so the ends find equal subtrees only if their hash functors return the same
+ * values in both processes. The standard hash functors of integers and strings
+ * do so for processes built with the same library.
+ *
+ * The stream is any object with the members:
+ *
+ * void write(const char* s, size_t n);  // writes n bytes
+ * void read(char* s, size_t n);         // reads n bytes
+ * void flush();                         // sends buffered bytes
+ *
+ * which includes std::iostream. Reads must throw if the stream fails, which
+ * std::iostream does with exceptions enabled by stream.exceptions(). The
+ * synchronizer throws std::runtime_error if the peer violates the protocol.
+ *
+ * @tparam Container type of synchronized containers, a set or a map
+ * @tparam Codec encodes the values of the container, see codec
+ **/
+template <class Container,
+          class Codec = codec<typename Container::value_type>>
+class synchronizer {
+  typedef typename internal::access::traits<Container>::type traits;
+  typedef internal::node_ptr<traits> node_ptr;
+  typedef typename Container::value_type value_type;
+  typedef typename Container::provider_ptr provider_ptr;
+  typedef internal::fingerprint_cache<traits, Codec> fingerprint_cache;
+
+  enum : unsigned char { match, send_all, expand };
+
+ public:
+  typedef Container container_type;
+
+  /**
+   * Constructs a new synchronizer.
+   *
+   * @param options options that control the exchange of digests
+   **/
+  explicit synchronizer(const sync_options& options = sync_options())
+      : options_(options) {}
+
+  synchronizer(const synchronizer&) = delete;
+  synchronizer& operator=(const synchronizer&) = delete;
+
+  /**
+   * Destructor.
+   **/
+  ~synchronizer() { clear(); }
+
+  /**
+   * Sends the contents of a container to a peer calling pull().
+   *
+   * @param stream stream connected to the peer
+   * @param source the container to send
+   *
+   * Let n be the size of the source.
+   * Let d be the number of elements that differ between the source and the
+   * replica.
+   *
+   * Complexity: O(d * log(n/d)) expected time and transferred bytes, in
+   * O(log n) round trips.
+   **/
+  template <class Stream>
+  void serve(Stream& stream, const Container& source) {
+    internal::env<traits> env(bind(source));
+    handshake(stream, 'S', 'R');
+    std::vector<const node_ptr*> frontier{&internal::access::node(source)};
+    std::vector<const node_ptr*> next;
+    for (;;) {
+      internal::write_uint64(stream, frontier.size());
+      for (const node_ptr* p : frontier) {
+        internal::write_uint64(stream, internal::size(*p));
+        write_digest(stream, *p);
+      }
+      stream.flush();
+      if (frontier.empty())
+        return;
+      next.clear();
+      for (const node_ptr* p : frontier) {
+        char code;
+        stream.read(&code, 1);
+        if (code == send_all) {
+          write_elements(stream, *p);
+        } else if (code == expand && *p) {
+          Codec::write(stream, (*p)->value());
+          next.push_back(&(*p)->left_);
+          next.push_back(&(*p)->right_);
+        } else if (code != match) {
+          throw std::runtime_error("sync protocol error");
+        }
+      }
+      frontier.swap(next);
+    }
+  }
+
+  /**
+   * Receives the contents of a container from a peer calling serve().
+   *
+   * @param stream stream connected to the peer
+   * @param replica a container sharing elements with the source
+   * @return a container equal to the source, using the provider of the
+   *   replica and sharing its nodes within equal key ranges
+   *
+   * Complexity: O(d * log(n/d) * log n) expected time and O(d * log(n/d))
+   * transferred bytes, in O(log n) round trips.
+   **/
+  template <class Stream>
+  Container pull(Stream& stream, const Container& replica) {
+    struct part {
+      node_ptr node_;
+      size_t value_;
+      size_t left_;
+    };
+    struct range {
+      size_t part_;
+      node_ptr node_;
+    };
+    const size_t none = size_t(-1);
+
+    internal::env<traits> env(bind(replica));
+    handshake(stream, 'R', 'S');
+    // Only the nodes of the replica are cached beyond this call, and the nodes
+    // created by cutting out ranges are fingerprinted in a scratch cache.
+    fingerprint_cache scratch(&fingerprints_);
+    if (options_.fingerprint == fingerprint_mode::strong)
+      fingerprints_.get(internal::access::node(replica));
+    std::vector<part> parts{{nullptr, none, 0}};
+    std::vector<value_type> values;
+    std::vector<range> frontier{{0, internal::access::node(replica)}};
+    std::vector<range> next;
+    std::vector<char> codes;
+    std::vector<size_t> sizes;
+    std::vector<value_type> elements;
+    while (internal::read_uint64(stream) == frontier.size()) {
+      if (frontier.empty())
+        return internal::access::make<Container>(replica.provider(),
+                                                 assemble(env, parts, values));
+      codes.clear();
+      sizes.clear();
+      for (const range& r : frontier) {
+        size_t n = internal::read_uint64(stream);
+        bool equal = read_digest(stream) == digest(scratch, r.node_);
+        codes.push_back(n == internal::size(r.node_) && equal
+                            ? match
+                            : n <= options_.leaf_size ? send_all : expand);
+        sizes.push_back(n);
+      }
+      stream.write(codes.data(), codes.size());
+      stream.flush();
+      next.clear();
+      for (size_t i = 0; i < frontier.size(); ++i) {
+        range& r = frontier[i];
+        if (codes[i] == match) {
+          parts[r.part_].node_ = std::move(r.node_);
+        } else if (codes[i] == send_all) {
+          elements.clear();
+          for (size_t j = 0; j < sizes[i]; ++j)
+            elements.push_back(Codec::read(stream));
+          parts[r.part_].node_ =
+              make_sorted_node(env, elements.begin(), elements.end());
+        } else {
+          values.push_back(Codec::read(stream));
+          const auto& key = key_of(env, values.back());
+          size_t left = parts.size();
+          parts[r.part_].value_ = values.size() - 1;
+          parts[r.part_].left_ = left;
+          parts.push_back({nullptr, none, 0});
+          parts.push_back({nullptr, none, 0});
+          auto s = internal::split(env, std::move(r.node_), key);
+          next.push_back({left, std::move(s.first)});
+          next.push_back({left + 1, erase(env, s.second, key).first});
+        }
+      }
+      frontier.swap(next);
+    }
+    throw std::runtime_error("sync protocol error");
+  }
+
+  /**
+   * Drops the cached strong fingerprints.
+   **/
+  void clear() {
+    if (provider_) {
+      internal::env<traits> env(provider_.get());
+      fingerprints_.clear();
+    }
+  }
+
+ private:
+  // Binds the synchronizer to the provider of a container. Cached
+  // fingerprints are dropped when the provider changes.
+  typename Container::provider_type* bind(const Container& container) {
+    if (provider_ != container.provider()) {
+      clear();
+      provider_ = container.provider();
+    }
+    return provider_.get();
+  }
+
+  template <class Stream>
+  void handshake(Stream& stream, char role, char peer) {
+    char header[6] = {'C', 'F', 'S', '1', role,
+                      static_cast<char>(options_.fingerprint)};
+    stream.write(header, sizeof(header));
+    stream.flush();
+    char other[6];
+    stream.read(other, sizeof(other));
+    header[4] = peer;
+    if (!std::equal(header, header + sizeof(header), other))
+      throw std::runtime_error("sync handshake failed");
+  }
+
+  internal::fingerprint digest(fingerprint_cache& cache, const node_ptr& p) {
+    if (options_.fingerprint == fingerprint_mode::strong)
+      return cache.get(p);
+    return {internal::hash(p), 0};
+  }
+
+  template <class Stream>
+  void write_digest(Stream& stream, const node_ptr& p) {
+    internal::fingerprint f = digest(fingerprints_, p);
+    internal::write_uint64(stream, f.high_);
+    if (options_.fingerprint == fingerprint_mode::strong)
+      internal::write_uint64(stream, f.low_);
+  }
+
+  template <class Stream>
+  internal::fingerprint read_digest(Stream& stream) {
+    internal::fingerprint f = {internal::read_uint64(stream), 0};
+    if (options_.fingerprint == fingerprint_mode::strong)
+      f.low_ = internal::read_uint64(stream);
+    return f;
+  }
+
+  template <class Stream>
+  static void write_elements(Stream& stream, const node_ptr& p) {
+    if (p) {
+      write_elements(stream, p->left_);
+      Codec::write(stream, p->value());
+      write_elements(stream, p->right_);
+    }
+  }
+
+  template <class Parts>
+  static node_ptr assemble(const internal::env<traits>& env,
+                           const Parts& parts,
+                           const std::vector<value_type>& values,
+                           size_t i = 0) {
+    if (parts[i].value_ == size_t(-1))
+      return parts[i].node_;
+    return make_node(env, values[parts[i].value_],
+                     assemble(env, parts, values, parts[i].left_),
+                     assemble(env, parts, values, parts[i].left_ + 1));
+  }
+
+  sync_options options_;
+  provider_ptr provider_;
+  fingerprint_cache fingerprints_;
+};
+
+}  // namespace confluent
+
+#endif  // CONFLUENT_SYNC_H_INCLUDED